@@ -6,22 +6,201 @@
 enum {
 	USB_PACKET_INITIALIZE,
 	USB_PACKET_LOG,
+	USB_PACKET_RAW,
+	USB_PACKET_CAPTURE_BEGIN,
+	USB_PACKET_CAPTURE_END,
+	USB_PACKET_TRACE,
+	USB_PACKET_STORE_ENTRY,
+	USB_PACKET_RAW_RESYNC, /* uint8_t number of bytes dropped, at most 255 */
 };
 
+/* Vendor requests, addressed to interface 0 */
+enum {
+	USB_REQ_SET_MODE = 1,
+	USB_REQ_TRACE,    /* dump the trace ring in USB_PACKET_TRACE packets */
+	USB_REQ_GENERATE, /* plot synthetic captures instead of the UART input;
+	                     the low byte of wValue is the number of captures
+	                     and the high byte the rate in bytes per ms, or 0
+	                     for as fast as possible. 0 captures finishes the
+	                     plot in progress and stops */
+	USB_REQ_STORE,    /* wValue 1 stores captures in flash instead of
+	                     sending them, 0 sends them again. They are also
+	                     stored while the host is not reading them */
+	USB_REQ_STORE_LIST,  /* list the stored captures in
+	                        USB_PACKET_STORE_ENTRY packets */
+	USB_REQ_STORE_FETCH, /* send the stored capture whose capture_seq has
+	                        the low 16 bits of wValue, as it was
+	                        captured */
+};
+
+enum {
+	MODE_CONVERT, /* HPGL is converted to drawing operations on the device */
+	MODE_RAW,     /* HPGL is forwarded unmodified in USB_PACKET_RAW packets */
+};
+
+/* In MODE_RAW, input dropped after an overflow and commands cut short by a
+ * change of mode are reported by USB_PACKET_RAW_RESYNC, after which the
+ * receiver starts lexing afresh at the next command. */
+
+/* The payloads of consecutive USB_PACKET_LOG packets form a single stream of
+ * drawing operations, and each payload holds whole operations only. Each
+ * operation is an opcode byte followed by its arguments. Coordinates are
+ * little-endian int16_t values in plotter units, as received from the
+ * oscilloscope. Bytes from OP_TEXT upwards are label characters. */
+enum {
+	OP_BEGIN,         /* start of a capture, resets the line type to 0 */
+	OP_END,           /* end of a capture */
+	OP_PEN,           /* uint8_t pen */
+	OP_LINE_TYPE,     /* uint8_t line type */
+	OP_POLYLINE,      /* start of a polyline */
+	OP_POINT,         /* int16_t x, y */
+	OP_POLYLINE_END,  /* end of a polyline */
+	OP_LINE,          /* int16_t x0, y0, x1, y1 */
+	OP_MARKER,        /* int16_t x, y */
+	OP_LABEL,         /* int16_t x, y; followed by the label text */
+	OP_LABEL_END,     /* end of a label */
+	OP_RESYNC,        /* input was dropped after an overflow */
+	OP_RUN,           /* int16_t x, y; int8_t dx; uint8_t count; dy nibbles */
+
+	OP_TEXT = 0x20,
+};
+
+/* OP_RUN encodes a stretch of trace points with a constant x step. The first
+ * point is (x, y) and each of the following count points adds dx to x and a
+ * signed 4-bit delta to y. The deltas are packed two to a byte, low nibble
+ * first, in (count + 1) / 2 bytes after the header. */
+#define OP_RUN_HEADER 7
+#define OP_RUN_MAX 64
+
+/* Size of the operation starting at buf, given the len bytes of it that are
+ * available, which for OP_RUN need to include its header */
+static inline uint8_t op_size(const uint8_t *buf, uint8_t len)
+{
+	switch (buf[0]) {
+	case OP_PEN:
+	case OP_LINE_TYPE:
+		return 2;
+	case OP_POINT:
+	case OP_MARKER:
+	case OP_LABEL:
+		return 5;
+	case OP_LINE:
+		return 9;
+	case OP_RUN:
+		if (len < OP_RUN_HEADER) {
+			return OP_RUN_HEADER;
+		}
+
+		return OP_RUN_HEADER + ((buf[6] < OP_RUN_MAX ? buf[6] : OP_RUN_MAX) +
+				1) / 2;
+	default:
+		return 1;
+	}
+}
+
+/* Every packet starts with the same header. seq counts up by one for each
+ * packet sent, so that the receiver can detect lost packets, and crc is the
+ * CRC-8 of the whole packet, computed with the crc field itself as zero. */
+#define USB_PACKET_HEADER 4
+#define USB_PACKET_MAX 64
+
 struct usb_packet_any {
 	uint8_t length;
 	uint8_t type;
+	uint8_t seq;
+	uint8_t crc;
 };
 
 struct usb_packet_initialize {
 	uint8_t length;
 	uint8_t type;
+	uint8_t seq;
+	uint8_t crc;
 };
 
+/* Drawing operations never span two log packets, so the receiver can start
+ * decoding afresh at the next packet after a packet is lost. */
 struct usb_packet_log {
 	uint8_t length;
 	uint8_t type;
-	char payload [62];
+	uint8_t seq;
+	uint8_t crc;
+	char payload [USB_PACKET_MAX - USB_PACKET_HEADER];
+};
+
+/* Sent in MODE_CONVERT before the first and after the last log packet of a
+ * capture. bytes is the number of log payload bytes in the capture. */
+struct usb_packet_capture_begin {
+	uint8_t length;
+	uint8_t type;
+	uint8_t seq;
+	uint8_t crc;
+	uint16_t id;
+};
+
+struct usb_packet_capture_end {
+	uint8_t length;
+	uint8_t type;
+	uint8_t seq;
+	uint8_t crc;
+	uint16_t id;
+	uint32_t bytes;
+};
+
+/* Trace events are timestamped in microseconds by a free-running 32-bit
+ * counter, so times wrap after about 71 minutes. */
+enum {
+	TRACE_UART,          /* first byte received after an idle period */
+	TRACE_CAPTURE_BEGIN, /* value is the capture id */
+	TRACE_CAPTURE_END,   /* value is the capture id */
+	TRACE_COMMAND,       /* an HPGL command is dispatched, value is the
+	                        mnemonic */
+	TRACE_USB_SUBMIT,    /* value is the packet sequence number */
+	TRACE_USB_COMPLETE,  /* value is the packet sequence number */
+	TRACE_QUEUE,         /* new token queue high-water mark, value is the
+	                        queue depth */
+};
+
+struct trace_event {
+	uint32_t time;
+	uint16_t value;
+	uint8_t type;
+	uint8_t reserved;
+};
+
+#define TRACE_PACKET_EVENTS 7
+
+/* A trace dump is sent oldest event first. index is the position of the
+ * first event of the packet in the dump and total is the number of events
+ * in the whole dump. */
+struct usb_packet_trace {
+	uint8_t length;
+	uint8_t type;
+	uint8_t seq;
+	uint8_t crc;
+	uint8_t index;
+	uint8_t total;
+	uint16_t reserved;
+	struct trace_event events [TRACE_PACKET_EVENTS];
+};
+
+/* Stored captures are listed oldest first, index being the position of the
+ * capture in the list and total the number of captures in it. An empty
+ * store is listed as a single packet with total 0, which also answers a
+ * fetch of a capture no longer stored. capture_seq numbers the stored
+ * captures across restarts. stored is the number of bytes stored, less than
+ * bytes if the capture did not fit. */
+struct usb_packet_store_entry {
+	uint8_t length;
+	uint8_t type;
+	uint8_t seq;
+	uint8_t crc;
+	uint8_t index;
+	uint8_t total;
+	uint16_t id;
+	uint32_t capture_seq;
+	uint32_t stored;
+	uint32_t bytes;
 };
 
 union usb_packet_out {
@@ -29,4 +208,30 @@ union usb_packet_out {
 	struct usb_packet_initialize initialize;
 };
 
+union usb_packet_in {
+	struct usb_packet_any any;
+	struct usb_packet_log log;
+	struct usb_packet_capture_begin capture_begin;
+	struct usb_packet_capture_end capture_end;
+	struct usb_packet_trace trace;
+	struct usb_packet_store_entry store_entry;
+	uint8_t data [USB_PACKET_MAX];
+};
+
+static inline uint8_t usb_packet_crc(const void *packet)
+{
+	const uint8_t *data = packet;
+	uint8_t crc = 0;
+
+	for (int i = 0; i < data[0]; i++) {
+		crc ^= i == 3 ? 0 : data[i];
+
+		for (int j = 0; j < 8; j++) {
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+	}
+
+	return crc;
+}
+
 #endif /* COMMON_H */
@@ -0,0 +1,784 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "archive.h"
+#include "common.h"
+#include "delta.h"
+#include "mask.h"
+#include "measure.h"
+#include "raw.h"
+#include "svg.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define ALIGN(n) (((n) + ARCHIVE_ALIGN - 1) & ~(uint64_t) (ARCHIVE_ALIGN - 1))
+
+uint64_t archive_time()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int write_data(struct archive_writer *w, const void *data, size_t len)
+{
+	if (fwrite(data, 1, len, w->file) != len) {
+		return -1;
+	}
+
+	w->offset += len;
+
+	return 0;
+}
+
+static int write_padding(struct archive_writer *w)
+{
+	static const uint8_t zeros [ARCHIVE_ALIGN];
+
+	return write_data(w, zeros, ALIGN(w->offset) - w->offset);
+}
+
+int archive_create(struct archive_writer *w, const char *path,
+		const char *serial, int delta)
+{
+	struct archive_header header = {
+		.magic = "DSOA",
+		.version = delta ? ARCHIVE_VERSION_DELTA : ARCHIVE_VERSION,
+		.time = archive_time(),
+	};
+
+	memset(w, 0, sizeof(*w));
+	strncpy(header.serial, serial, sizeof(header.serial) - 1);
+
+	if (delta) {
+		if (!(w->delta = malloc(sizeof(*w->delta)))) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+
+		delta_init(w->delta);
+	}
+
+	/* An archive is never reopened for writing, so that a session can not
+	 * overwrite an earlier one */
+	if (!(w->file = fopen(path, "wbx"))) {
+		perror(path);
+		free(w->delta);
+		w->delta = 0;
+		return -1;
+	}
+
+	if (write_data(w, &header, sizeof(header)) < 0 || fflush(w->file)) {
+		perror(path);
+		fclose(w->file);
+		free(w->delta);
+		w->file = 0;
+		w->delta = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+int archive_append(struct archive_writer *w, uint16_t id, uint8_t mode,
+		uint8_t flags, const void *data, uint32_t length)
+{
+	const void *capture = data;
+	uint32_t capture_length = length;
+
+	if (w->count == w->size) {
+		size_t size = w->size ? w->size * 2 : 64;
+		struct archive_entry *entries = realloc(w->entries,
+				size * sizeof(*entries));
+
+		if (!entries) {
+			return -1;
+		}
+
+		w->entries = entries;
+		w->size = size;
+	}
+
+	if (w->delta) {
+		if (w->count % ARCHIVE_KEYFRAME == 0) {
+			delta_reset(w->delta);
+		}
+
+		int r = delta_encode(w->delta, mode, data, length);
+
+		if (r < 0) {
+			return -1;
+		}
+
+		if (r) {
+			flags |= ARCHIVE_DELTA;
+			data = w->delta->out;
+			length = w->delta->out_length;
+		}
+	}
+
+	struct archive_record record = {
+		.magic = "DSOR",
+		.length = length,
+		.time = archive_time(),
+		.id = id,
+		.mode = mode,
+		.flags = flags,
+	};
+
+	w->entries[w->count] = (struct archive_entry) {
+		.offset = w->offset,
+		.time = record.time,
+		.length = length,
+		.id = id,
+		.mode = mode,
+		.flags = flags,
+	};
+
+	/* Each record is flushed, so that an interrupted session loses at most
+	 * the capture being received */
+	if (write_data(w, &record, sizeof(record)) < 0 ||
+			write_data(w, data, length) < 0 ||
+			write_padding(w) < 0 || fflush(w->file)) {
+		return -1;
+	}
+
+	/* Records are decoded against the one before them in the archive, so
+	 * the base only moves on once the capture is there. Out of memory, the
+	 * next capture is stored whole. */
+	if (w->delta) {
+		delta_set_base(w->delta, mode, capture, capture_length);
+	}
+
+	w->count++;
+
+	return 0;
+}
+
+int archive_close(struct archive_writer *w)
+{
+	struct archive_trailer trailer = {
+		.index = w->offset,
+		.count = w->count,
+		.magic = "DSOX",
+	};
+	int r = 0;
+
+	if (write_data(w, w->entries, w->count * sizeof(*w->entries)) < 0 ||
+			write_data(w, &trailer, sizeof(trailer)) < 0) {
+		r = -1;
+	}
+
+	if (fclose(w->file)) {
+		r = -1;
+	}
+
+	if (w->delta) {
+		delta_free(w->delta);
+		free(w->delta);
+	}
+
+	free(w->entries);
+	w->file = 0;
+	w->entries = 0;
+	w->delta = 0;
+
+	return r;
+}
+
+/* A read-only view of an archive. entries points either into the mapped
+ * index or, for an archive without a trailer, to an index built by
+ * scanning the records. */
+struct archive {
+	const uint8_t *map;
+	size_t size;
+	const struct archive_header *header;
+	const struct archive_entry *entries;
+	struct archive_entry *scanned;
+	uint64_t count;
+};
+
+static int find_index(struct archive *a)
+{
+	const struct archive_trailer *trailer;
+
+	if (a->size < sizeof(struct archive_header) + sizeof(*trailer)) {
+		return 0;
+	}
+
+	trailer = (const void *) (a->map + a->size - sizeof(*trailer));
+
+	if (memcmp(trailer->magic, "DSOX", 4) != 0 ||
+			trailer->index % ARCHIVE_ALIGN != 0 ||
+			trailer->index > a->size - sizeof(*trailer) ||
+			(a->size - sizeof(*trailer) - trailer->index) /
+			sizeof(struct archive_entry) != trailer->count) {
+		return 0;
+	}
+
+	a->entries = (const void *) (a->map + trailer->index);
+	a->count = trailer->count;
+
+	return 1;
+}
+
+static int scan_records(struct archive *a)
+{
+	uint64_t offset = sizeof(struct archive_header);
+	size_t size = 0;
+
+	while (offset + sizeof(struct archive_record) <= a->size) {
+		const struct archive_record *record = (const void *) (a->map + offset);
+
+		if (memcmp(record->magic, "DSOR", 4) != 0 ||
+				record->length > a->size - offset - sizeof(*record)) {
+			break;
+		}
+
+		if (a->count == size) {
+			size = size ? size * 2 : 64;
+
+			struct archive_entry *entries = realloc(a->scanned,
+					size * sizeof(*entries));
+
+			if (!entries) {
+				return -1;
+			}
+
+			a->scanned = entries;
+		}
+
+		a->scanned[a->count++] = (struct archive_entry) {
+			.offset = offset,
+			.time = record->time,
+			.length = record->length,
+			.id = record->id,
+			.mode = record->mode,
+			.flags = record->flags,
+		};
+
+		offset = ALIGN(offset + sizeof(*record) + record->length);
+	}
+
+	a->entries = a->scanned;
+
+	return 0;
+}
+
+static int archive_open(struct archive *a, const char *path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	memset(a, 0, sizeof(*a));
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		return -1;
+	}
+
+	if ((size_t) st.st_size < sizeof(struct archive_header)) {
+		fprintf(stderr, "%s: not an archive\n", path);
+		close(fd);
+		return -1;
+	}
+
+	a->size = st.st_size;
+	a->map = mmap(0, a->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (a->map == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+
+	a->header = (const void *) a->map;
+
+	if (memcmp(a->header->magic, "DSOA", 4) != 0 ||
+			(a->header->version != ARCHIVE_VERSION &&
+			a->header->version != ARCHIVE_VERSION_DELTA)) {
+		fprintf(stderr, "%s: not an archive\n", path);
+		munmap((void *) a->map, a->size);
+		return -1;
+	}
+
+	if (!find_index(a)) {
+		fprintf(stderr, "%s: no index, scanning records\n", path);
+
+		if (scan_records(a) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			munmap((void *) a->map, a->size);
+			free(a->scanned);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void archive_unmap(struct archive *a)
+{
+	munmap((void *) a->map, a->size);
+	free(a->scanned);
+}
+
+static const uint8_t *record_data(struct archive *a, uint64_t n)
+{
+	const struct archive_entry *entry = &a->entries[n];
+
+	if (entry->offset > a->size ||
+			entry->length + sizeof(struct archive_record) >
+			a->size - entry->offset) {
+		fprintf(stderr, "Record %llu is truncated\n", (unsigned long long) n);
+		return 0;
+	}
+
+	return a->map + entry->offset + sizeof(struct archive_record);
+}
+
+/* Reads captures, reconstructing differential records from the capture
+ * before. The last capture is kept, so that reading records in order
+ * decodes each of them once. */
+struct reader {
+	struct archive *archive;
+	uint64_t n;
+	const uint8_t *data;
+	uint32_t length;
+	uint8_t *decoded;
+};
+
+static void reader_init(struct reader *r, struct archive *a)
+{
+	r->archive = a;
+	r->n = 0;
+	r->data = 0;
+	r->length = 0;
+	r->decoded = 0;
+}
+
+static void reader_free(struct reader *r)
+{
+	free(r->decoded);
+	r->data = 0;
+	r->decoded = 0;
+}
+
+static const uint8_t *read_capture(struct reader *r, uint64_t n,
+		uint32_t *length)
+{
+	struct archive *a = r->archive;
+	uint64_t first = n;
+
+	if (r->data && r->n == n) {
+		*length = r->length;
+		return r->data;
+	}
+
+	/* Back to the last whole record, or to the one held */
+	while (a->entries[first].flags & ARCHIVE_DELTA &&
+			!(r->data && r->n + 1 == first)) {
+		if (first == 0) {
+			fprintf(stderr, "Record %llu has no base\n",
+					(unsigned long long) n);
+			reader_free(r);
+			return 0;
+		}
+
+		first--;
+	}
+
+	for (uint64_t i = first; i <= n; i++) {
+		const struct archive_entry *entry = &a->entries[i];
+		const uint8_t *data = record_data(a, i);
+		uint32_t len = entry->length;
+		uint8_t *decoded = 0;
+
+		if (!data) {
+			reader_free(r);
+			return 0;
+		}
+
+		if (entry->flags & ARCHIVE_DELTA) {
+			if (!(decoded = delta_decode(r->data, r->length, data, len,
+					&len))) {
+				fprintf(stderr, "Record %llu is corrupt\n",
+						(unsigned long long) i);
+				reader_free(r);
+				return 0;
+			}
+
+			data = decoded;
+		}
+
+		free(r->decoded);
+		r->decoded = decoded;
+		r->data = data;
+		r->length = len;
+		r->n = i;
+	}
+
+	*length = r->length;
+
+	return r->data;
+}
+
+static void list(struct archive *a)
+{
+	printf("serial %s, %llu captures\n", a->header->serial,
+			(unsigned long long) a->count);
+
+	for (uint64_t i = 0; i < a->count; i++) {
+		const struct archive_entry *entry = &a->entries[i];
+		time_t t = entry->time / 1000000;
+		char date [32];
+
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		printf("%llu\t%s.%03u\tid %u\t%s\t%u bytes%s%s\n",
+				(unsigned long long) i + 1, date,
+				(unsigned) (entry->time / 1000 % 1000), entry->id,
+				entry->mode == MODE_RAW ? "raw" : "ops", entry->length,
+				entry->flags & ARCHIVE_DELTA ? "\tdelta" : "",
+				entry->flags & ARCHIVE_INCOMPLETE ? "\tincomplete" : "");
+	}
+}
+
+/* Passes the drawing operations of a capture to func */
+static void decode(uint8_t mode, const uint8_t *data, uint32_t length,
+		op_func func, void *ctx)
+{
+	struct op_decoder dec;
+
+	op_decoder_init(&dec, func, ctx);
+
+	if (mode == MODE_RAW) {
+		struct raw raw;
+
+		raw_init(&raw, &dec);
+		raw_feed(&raw, data, length);
+	} else {
+		op_decoder_feed(&dec, data, length);
+	}
+}
+
+static void render(uint8_t mode, const uint8_t *data, uint32_t length)
+{
+	struct svg svg;
+
+	svg_init(&svg, stdout);
+	decode(mode, data, length, svg_op, &svg);
+}
+
+struct test {
+	struct archive *archive;
+	const struct mask *mask;
+	int *results;
+	atomic_size_t next;
+};
+
+/* Records are handed out in small batches from a shared counter */
+#define TEST_BATCH 256
+
+static void *test_worker(void *arg)
+{
+	struct test *test = arg;
+	struct archive *a = test->archive;
+	struct mask_trace t;
+	struct reader r;
+	size_t first;
+
+	reader_init(&r, a);
+
+	while ((first = atomic_fetch_add(&test->next, TEST_BATCH)) < a->count) {
+		size_t end = MIN(first + TEST_BATCH, a->count);
+
+		for (size_t i = first; i < end; i++) {
+			uint32_t length;
+			const uint8_t *data = read_capture(&r, i, &length);
+
+			if (!data) {
+				test->results[i] = -2;
+				continue;
+			}
+
+			mask_trace_init(&t, test->mask->pen);
+			decode(a->entries[i].mode, data, length, mask_trace_op, &t);
+			test->results[i] = t.points ? mask_test(test->mask, &t) : -1;
+		}
+	}
+
+	reader_free(&r);
+
+	return 0;
+}
+
+static int test(struct archive *a, const char *mask_path)
+{
+	struct test test = {.archive = a};
+	struct mask *mask = malloc(sizeof(*mask));
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads [64];
+	int started = 0;
+	uint64_t failed = 0;
+
+	if (!mask || !(test.results = calloc(a->count + 1, sizeof(int)))) {
+		fprintf(stderr, "Out of memory\n");
+		free(mask);
+		return 1;
+	}
+
+	if (mask_load(mask, mask_path) < 0) {
+		free(mask);
+		free(test.results);
+		return 1;
+	}
+
+	test.mask = mask;
+	atomic_init(&test.next, 0);
+	jobs = MIN(MAX(jobs, 1), 64);
+
+	for (int i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], 0, test_worker, &test)) {
+			break;
+		}
+
+		started++;
+	}
+
+	if (!started) {
+		test_worker(&test);
+	}
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], 0);
+	}
+
+	for (uint64_t i = 0; i < a->count; i++) {
+		int n = test.results[i];
+
+		printf("%llu\tid %u\t", (unsigned long long) i + 1,
+				a->entries[i].id);
+
+		if (n == 0) {
+			printf("PASS\n");
+			continue;
+		}
+
+		failed++;
+
+		if (n > 0) {
+			printf("FAIL\t%d columns outside the mask\n", n);
+		} else if (n == -1) {
+			printf("FAIL\tno trace for pen %d\n", mask->pen);
+		} else {
+			printf("FAIL\tunreadable record\n");
+		}
+	}
+
+	fprintf(stderr, "%llu of %llu captures failed\n",
+			(unsigned long long) failed, (unsigned long long) a->count);
+
+	free(mask);
+	free(test.results);
+
+	return failed ? 2 : 0;
+}
+
+static void measure(struct archive *a, int csv)
+{
+	struct measure *m = malloc(sizeof(*m));
+	struct reader r;
+
+	if (!m) {
+		fprintf(stderr, "Out of memory\n");
+		return;
+	}
+
+	if (csv) {
+		measure_write_csv_header(stdout);
+	}
+
+	reader_init(&r, a);
+
+	for (uint64_t i = 0; i < a->count; i++) {
+		uint32_t length;
+		const uint8_t *data = read_capture(&r, i, &length);
+
+		if (!data) {
+			continue;
+		}
+
+		measure_init(m);
+		decode(a->entries[i].mode, data, length, measure_op, m);
+
+		if (csv) {
+			measure_write_csv(stdout, m, i + 1);
+		} else {
+			measure_write_json(stdout, m, i + 1);
+		}
+	}
+
+	reader_free(&r);
+	free(m);
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: dsoctl archive list archive\n");
+	fprintf(stderr, "       dsoctl archive extract archive n [out-file]\n");
+	fprintf(stderr, "       dsoctl archive render archive n\n");
+	fprintf(stderr, "       dsoctl archive mask archive n pen tolerance\n");
+	fprintf(stderr, "       dsoctl archive test archive mask-file\n");
+	fprintf(stderr, "       dsoctl archive measure archive [csv]\n");
+	fprintf(stderr, "Capture n is numbered from 1 as shown by list. extract "
+			"writes the capture's\ndata as received, render converts it to "
+			"SVG on stdout. mask writes a mask\nallowing tolerance around "
+			"the trace of the given pen, and test tests every\ncapture "
+			"against a mask. measure writes measurements of every capture "
+			"as JSON\nlines or CSV.\n");
+}
+
+static int make_mask(uint8_t mode, const uint8_t *data, uint32_t length,
+		int pen, int tolerance)
+{
+	struct mask_trace *t = malloc(sizeof(*t));
+
+	if (!t) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	mask_trace_init(t, pen);
+	decode(mode, data, length, mask_trace_op, t);
+
+	if (!t->points) {
+		fprintf(stderr, "No trace for pen %d\n", pen);
+		free(t);
+		return 1;
+	}
+
+	mask_write(stdout, t, tolerance);
+	free(t);
+
+	return 0;
+}
+
+int archive_main(int argc, char *argv[])
+{
+	struct archive a;
+	const char *cmd = argv[1];
+	uint64_t n = 0;
+	int r = 0;
+
+	if (argc < 3 || (strcmp(cmd, "list") != 0 &&
+				strcmp(cmd, "measure") != 0 && argc < 4) ||
+			(strcmp(cmd, "mask") == 0 && argc < 6)) {
+		usage();
+		return 1;
+	}
+
+	if (archive_open(&a, argv[2]) < 0) {
+		return 1;
+	}
+
+	if (strcmp(cmd, "list") == 0) {
+		list(&a);
+		archive_unmap(&a);
+		return 0;
+	}
+
+	if (strcmp(cmd, "measure") == 0) {
+		measure(&a, argc > 3 && strcmp(argv[3], "csv") == 0);
+		archive_unmap(&a);
+		return 0;
+	}
+
+	if (strcmp(cmd, "test") == 0) {
+		r = test(&a, argv[3]);
+		archive_unmap(&a);
+		return r;
+	}
+
+	char *end;
+
+	n = strtoull(argv[3], &end, 10);
+
+	if (*end || n < 1 || n > a.count) {
+		fprintf(stderr, "No capture %s in %s\n", argv[3], argv[2]);
+		archive_unmap(&a);
+		return 1;
+	}
+
+	n--;
+
+	struct reader reader;
+	uint32_t length;
+
+	reader_init(&reader, &a);
+
+	const uint8_t *data = read_capture(&reader, n, &length);
+	uint8_t mode = a.entries[n].mode;
+
+	if (!data) {
+		r = 1;
+	} else if (strcmp(cmd, "extract") == 0) {
+		FILE *out = argc > 4 ? fopen(argv[4], "wb") : stdout;
+
+		if (!out) {
+			perror(argv[4]);
+			r = 1;
+		} else {
+			if (fwrite(data, 1, length, out) != length) {
+				perror("write");
+				r = 1;
+			}
+
+			if (out != stdout) {
+				fclose(out);
+			}
+		}
+	} else if (strcmp(cmd, "render") == 0) {
+		render(mode, data, length);
+	} else if (strcmp(cmd, "mask") == 0) {
+		r = make_mask(mode, data, length, atoi(argv[4]), atoi(argv[5]));
+	} else {
+		usage();
+		r = 1;
+	}
+
+	reader_free(&reader);
+	archive_unmap(&a);
+
+	return r;
+}
@@ -0,0 +1,106 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "delta.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* An archive holds the captures of one session. It starts with a header,
+ * followed by one record per capture and, once the session is closed, an
+ * index of the records and a trailer at the very end of the file. All
+ * structures are little-endian and records are padded to 8 bytes.
+ *
+ * A record holds the capture's data as received: the drawing operation
+ * stream for MODE_CONVERT or the HPGL for MODE_RAW. An archive without a
+ * trailer, left behind by an interrupted session, is read by scanning the
+ * records instead.
+ *
+ * In a differential archive, a record may instead hold the capture's delta
+ * encoding against the capture of the record before it. Every
+ * ARCHIVE_KEYFRAME records one is stored whole, which bounds the records
+ * read to reconstruct one. */
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_VERSION_DELTA 2
+#define ARCHIVE_ALIGN 8
+#define ARCHIVE_KEYFRAME 32
+
+enum {
+	ARCHIVE_INCOMPLETE = 1, /* data was lost while receiving the capture */
+	ARCHIVE_DELTA = 2,      /* the data is a delta encoding */
+};
+
+struct archive_header {
+	char magic [4];   /* "DSOA" */
+	uint32_t version;
+	uint64_t time;    /* microseconds since the epoch */
+	char serial [32]; /* serial number of the adapter */
+};
+
+struct archive_record {
+	char magic [4];   /* "DSOR" */
+	uint32_t length;  /* of the data following the record header */
+	uint64_t time;
+	uint16_t id;      /* capture id assigned by the adapter */
+	uint8_t mode;
+	uint8_t flags;
+	uint32_t reserved;
+};
+
+struct archive_entry {
+	uint64_t offset;  /* of the record header */
+	uint64_t time;
+	uint32_t length;
+	uint16_t id;
+	uint8_t mode;
+	uint8_t flags;
+};
+
+struct archive_trailer {
+	uint64_t index;   /* offset of the first index entry */
+	uint64_t count;
+	char magic [4];   /* "DSOX" */
+	uint32_t reserved;
+};
+
+struct archive_writer {
+	FILE *file;
+	uint64_t offset;
+	struct archive_entry *entries;
+	size_t count;
+	size_t size;
+	struct delta *delta;
+};
+
+/* With delta set, captures are stored as their changes from the one before
+ * where that is smaller */
+int archive_create(struct archive_writer *w, const char *path,
+		const char *serial, int delta);
+int archive_append(struct archive_writer *w, uint16_t id, uint8_t mode,
+		uint8_t flags, const void *data, uint32_t length);
+int archive_close(struct archive_writer *w);
+
+uint64_t archive_time();
+
+int archive_main(int argc, char *argv[]);
+
+#endif /* ARCHIVE_H */
@@ -0,0 +1,263 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "average.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void reset(struct average *a)
+{
+	memset(a->sum, 0, sizeof(a->sum));
+	memset(a->count, 0, sizeof(a->count));
+	a->added = 0;
+	a->next = 0;
+}
+
+int average_init(struct average *a, int window, int rolling)
+{
+	memset(a, 0, sizeof(*a));
+	a->window = window;
+	a->rolling = rolling;
+
+	for (int i = 0; i < AVERAGE_CHANNELS; i++) {
+		mask_trace_init(&a->trace[i], i + 2);
+	}
+
+	if (rolling && !(a->slots = aligned_alloc(sizeof(average_vec),
+					window * sizeof(*a->slots)))) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void average_free(struct average *a)
+{
+	free(a->slots);
+	a->slots = 0;
+}
+
+/* Adds the capture's traces to the sums, first taking out the capture that
+ * leaves a full rolling window */
+static void add(struct average *a)
+{
+	struct average_slot *slot = a->rolling ? &a->slots[a->next] : 0;
+
+	if (slot && a->added == a->window) {
+		for (int c = 0; c < AVERAGE_CHANNELS; c++) {
+			for (int i = 0; i < MASK_VECS; i++) {
+				a->sum[c][i] -= slot->mid2[c][i];
+				a->count[c][i] += slot->present[c][i];
+			}
+		}
+
+		a->added--;
+	}
+
+	for (int c = 0; c < AVERAGE_CHANNELS; c++) {
+		const struct mask_trace *t = &a->trace[c];
+
+		for (int i = 0; i < MASK_VECS; i++) {
+			average_vec present = __builtin_convertvector(t->lo[i] <= t->hi[i],
+					average_vec);
+			average_vec mid2 = (__builtin_convertvector(t->lo[i], average_vec) +
+					__builtin_convertvector(t->hi[i], average_vec)) & present;
+
+			a->sum[c][i] += mid2;
+			a->count[c][i] -= present;
+
+			if (slot) {
+				slot->mid2[c][i] = mid2;
+				slot->present[c][i] = present;
+			}
+		}
+	}
+
+	a->added++;
+
+	if (slot) {
+		a->next = (a->next + 1) % a->window;
+	}
+}
+
+/* Returns 1 at the end of a capture after which an average is due */
+int average_op(struct average *a, const struct op *op)
+{
+	if (op->code == OP_BEGIN) {
+		for (int i = 0; i < AVERAGE_CHANNELS; i++) {
+			mask_trace_init(&a->trace[i], i + 2);
+		}
+
+		a->pen = 0;
+		a->in_label = 0;
+		a->label_count = 0;
+	}
+
+	for (int i = 0; i < AVERAGE_CHANNELS; i++) {
+		mask_trace_op(&a->trace[i], op);
+	}
+
+	struct average_label *label = a->label_count ?
+		&a->labels[a->label_count - 1] : 0;
+
+	switch (op->code) {
+	case OP_PEN:
+		a->pen = op->arg[0];
+		break;
+	case OP_LABEL:
+		if (a->label_count < AVERAGE_LABELS) {
+			label = &a->labels[a->label_count++];
+			label->x = op->arg[0];
+			label->y = op->arg[1];
+			label->pen = a->pen;
+			label->len = 0;
+			a->in_label = 1;
+		}
+		break;
+	case OP_LABEL_END:
+		a->in_label = 0;
+		break;
+	case OP_END:
+		if (!a->rolling && a->added == a->window) {
+			reset(a);
+		}
+
+		add(a);
+		a->outputs += a->rolling || a->added == a->window;
+
+		return a->rolling || a->added == a->window;
+	default:
+		if (op->code >= OP_TEXT && a->in_label &&
+				label->len < AVERAGE_LABEL_MAX) {
+			label->text[label->len++] = op->code;
+		}
+	}
+
+	return 0;
+}
+
+/* Columns without a point in any of the captures are left out */
+static int column(const struct average *a, int c, int x, double *y)
+{
+	int count = a->count[c][x / MASK_LANES][x % MASK_LANES];
+
+	if (!count) {
+		return 0;
+	}
+
+	*y = a->sum[c][x / MASK_LANES][x % MASK_LANES] / 2.0 / count;
+
+	return 1;
+}
+
+static void emit(op_func func, void *ctx, uint8_t code, int arg0, int arg1)
+{
+	struct op op = {.code = code, .arg = {arg0, arg1}};
+
+	func(ctx, &op);
+}
+
+/* Passes the average as the drawing operations of a capture of its own,
+ * with the last capture's labels and a polyline for each stretch of
+ * columns of a channel */
+void average_replay(const struct average *a, op_func func, void *ctx)
+{
+	emit(func, ctx, OP_BEGIN, 0, 0);
+
+	for (int i = 0; i < a->label_count; i++) {
+		const struct average_label *label = &a->labels[i];
+
+		emit(func, ctx, OP_PEN, label->pen, 0);
+		emit(func, ctx, OP_LABEL, label->x, label->y);
+
+		for (int j = 0; j < label->len; j++) {
+			emit(func, ctx, (uint8_t) label->text[j], 0, 0);
+		}
+
+		emit(func, ctx, OP_LABEL_END, 0, 0);
+	}
+
+	for (int c = 0; c < AVERAGE_CHANNELS; c++) {
+		int in_line = 0;
+
+		emit(func, ctx, OP_PEN, c + 2, 0);
+
+		for (int x = 0; x < MASK_WIDTH; x++) {
+			double y;
+
+			if (!column(a, c, x, &y)) {
+				if (in_line) {
+					emit(func, ctx, OP_POLYLINE_END, 0, 0);
+					in_line = 0;
+				}
+
+				continue;
+			}
+
+			if (!in_line) {
+				emit(func, ctx, OP_POLYLINE, 0, 0);
+				in_line = 1;
+			}
+
+			emit(func, ctx, OP_POINT, x, y < 0 ? y - 0.5 : y + 0.5);
+		}
+
+		if (in_line) {
+			emit(func, ctx, OP_POLYLINE_END, 0, 0);
+		}
+	}
+
+	emit(func, ctx, OP_END, 0, 0);
+}
+
+void average_write_csv_header(FILE *out)
+{
+	fputs("average,captures,x,ch1,ch2\n", out);
+}
+
+/* One line per column, with the channels it has no point for left empty */
+void average_write_csv(FILE *out, const struct average *a)
+{
+	for (int x = 0; x < MASK_WIDTH; x++) {
+		double y [AVERAGE_CHANNELS];
+		int have [AVERAGE_CHANNELS];
+		int any = 0;
+
+		for (int c = 0; c < AVERAGE_CHANNELS; c++) {
+			any |= have[c] = column(a, c, x, &y[c]);
+		}
+
+		if (!any) {
+			continue;
+		}
+
+		fprintf(out, "%d,%d,%d", a->outputs, a->added, x);
+
+		for (int c = 0; c < AVERAGE_CHANNELS; c++) {
+			if (have[c]) {
+				fprintf(out, ",%.2f", y[c]);
+			} else {
+				fputc(',', out);
+			}
+		}
+
+		fputc('\n', out);
+	}
+}
@@ -0,0 +1,84 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef AVERAGE_H
+#define AVERAGE_H
+
+#include "mask.h"
+#include "ops.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/* Averages the traces of successive captures. Each capture's traces are
+ * reconstructed per column as for mask testing, so traces of the same
+ * channel line up by x, and the midpoints of the columns are accumulated in
+ * vectors of sums and counts.
+ *
+ * Every window captures the average of them is given and the sums start
+ * again, or, in a rolling window, the average of the last window captures
+ * is given after each one. Only a rolling window keeps the traces it
+ * averages, so memory is fixed by the window either way. */
+#define AVERAGE_CHANNELS 2
+#define AVERAGE_LABELS 16
+#define AVERAGE_LABEL_MAX 32
+
+typedef int32_t average_vec __attribute__((vector_size(32)));
+
+struct average_label {
+	int16_t x;
+	int16_t y;
+	int pen;
+	int len;
+	char text [AVERAGE_LABEL_MAX];
+};
+
+/* Twice the midpoint of each column of both channels, and -1 in the
+ * columns they have, for taking a capture out of a rolling window */
+struct average_slot {
+	average_vec mid2 [AVERAGE_CHANNELS][MASK_VECS];
+	average_vec present [AVERAGE_CHANNELS][MASK_VECS];
+};
+
+struct average {
+	int window;
+	int rolling;
+	struct mask_trace trace [AVERAGE_CHANNELS];
+	average_vec sum [AVERAGE_CHANNELS][MASK_VECS];
+	average_vec count [AVERAGE_CHANNELS][MASK_VECS];
+	struct average_slot *slots;
+	int added;
+	int next;
+	int outputs;
+
+	/* Labels of the last capture, repeated in the average. Text is
+	 * collected while in_label, and only for the labels stored. */
+	int pen;
+	int in_label;
+	int label_count;
+	struct average_label labels [AVERAGE_LABELS];
+};
+
+int average_init(struct average *a, int window, int rolling);
+void average_free(struct average *a);
+int average_op(struct average *a, const struct op *op);
+void average_replay(const struct average *a, op_func func, void *ctx);
+void average_write_csv_header(FILE *out);
+void average_write_csv(FILE *out, const struct average *a);
+
+#endif /* AVERAGE_H */
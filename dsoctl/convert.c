@@ -0,0 +1,691 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "convert.h"
+#include "measure.h"
+#include "persist.h"
+#include "raw.h"
+#include "svg.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OUT_BUF_SIZE (256 * 1024)
+
+/* Output formats, any of which can be written in one pass: SVG and a
+ * PNG of each capture, and a CSV of the measurements of all captures of a
+ * file, one line per capture */
+enum {
+	FORMAT_SVG = 1,
+	FORMAT_PNG = 2,
+	FORMAT_CSV = 4,
+};
+
+struct file_list {
+	char **paths;
+	size_t count;
+	size_t size;
+};
+
+/* Each worker starts with a contiguous share of the files. Once its own
+ * share is used up it takes files from the other workers' shares. Owner and
+ * thieves claim files with the same atomic counter, so no locks are
+ * needed. */
+struct share {
+	atomic_size_t next;
+	size_t end;
+};
+
+struct convert {
+	struct file_list files;
+	const char *out_dir;
+	int formats;
+	struct share *shares;
+	int worker_count;
+	atomic_int failures;
+};
+
+struct worker {
+	pthread_t thread;
+	struct convert *conv;
+	int id;
+
+	struct raw raw;
+	struct op_decoder dec;
+	struct svg svg;
+	char *out_buf;
+	struct persist *persist;
+	struct measure measure;
+	FILE *csv;
+
+	const char *input;
+	int capture;
+	int in_capture;
+};
+
+/* Paths are kept without "." components or repeated slashes, so that the
+ * same file named twice is converted once, and its outputs under -o are
+ * named after the path as given */
+static void normalise(char *path)
+{
+	char *in = path;
+	char *out = path;
+
+	if (*in == '/') {
+		*out++ = *in++;
+	}
+
+	while (*in) {
+		if (*in == '/') {
+			in++;
+		} else if (in[0] == '.' && (in[1] == '/' || !in[1])) {
+			in++;
+		} else {
+			if (out > path && out[-1] != '/') {
+				*out++ = '/';
+			}
+
+			while (*in && *in != '/') {
+				*out++ = *in++;
+			}
+		}
+	}
+
+	*out = 0;
+}
+
+static int add_file(struct file_list *files, const char *path)
+{
+	if (files->count == files->size) {
+		size_t size = files->size ? files->size * 2 : 64;
+		char **paths = realloc(files->paths, size * sizeof(*paths));
+
+		if (!paths) {
+			return -1;
+		}
+
+		files->paths = paths;
+		files->size = size;
+	}
+
+	if (!(files->paths[files->count] = strdup(path))) {
+		return -1;
+	}
+
+	normalise(files->paths[files->count]);
+	files->count++;
+
+	return 0;
+}
+
+static int has_suffix(const char *path, const char *suffix)
+{
+	size_t len = strlen(path);
+	size_t suffix_len = strlen(suffix);
+
+	return len >= suffix_len && strcmp(path + len - suffix_len, suffix) == 0;
+}
+
+/* Directories are searched for raw captures by their extension, while files
+ * named on the command line or by a glob are converted whatever their
+ * name */
+static int is_capture(const char *path)
+{
+	return has_suffix(path, ".hpgl") || has_suffix(path, ".plt");
+}
+
+static int add_path(struct file_list *files, const char *path, int named)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		return named || is_capture(path) ? add_file(files, path) : 0;
+	}
+
+	DIR *dir = opendir(path);
+
+	if (!dir) {
+		perror(path);
+		return -1;
+	}
+
+	struct dirent *ent;
+	int r = 0;
+
+	while (r == 0 && (ent = readdir(dir))) {
+		char child [PATH_MAX];
+
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+		r = add_path(files, child, 0);
+	}
+
+	closedir(dir);
+
+	return r;
+}
+
+static int add_arg(struct file_list *files, const char *arg)
+{
+	if (!strpbrk(arg, "*?[")) {
+		return add_path(files, arg, 1);
+	}
+
+	glob_t g;
+	int r = glob(arg, 0, 0, &g);
+
+	if (r == GLOB_NOMATCH) {
+		fprintf(stderr, "%s: no matches\n", arg);
+		return -1;
+	} else if (r) {
+		fprintf(stderr, "%s: glob failed\n", arg);
+		return -1;
+	}
+
+	for (size_t i = 0; r == 0 && i < g.gl_pathc; i++) {
+		r = add_path(files, g.gl_pathv[i], 1);
+	}
+
+	globfree(&g);
+
+	return r;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void remove_duplicates(struct file_list *files)
+{
+	size_t count = 0;
+
+	qsort(files->paths, files->count, sizeof(*files->paths), compare_paths);
+
+	for (size_t i = 0; i < files->count; i++) {
+		if (count && strcmp(files->paths[i], files->paths[count - 1]) == 0) {
+			free(files->paths[i]);
+		} else {
+			files->paths[count++] = files->paths[i];
+		}
+	}
+
+	files->count = count;
+}
+
+static int take_file(struct convert *conv, int id, size_t *index)
+{
+	for (int i = 0; i < conv->worker_count; i++) {
+		struct share *share = &conv->shares[(id + i) % conv->worker_count];
+
+		if (atomic_load(&share->next) >= share->end) {
+			continue;
+		}
+
+		size_t n = atomic_fetch_add(&share->next, 1);
+
+		if (n < share->end) {
+			*index = n;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Creates the directories leading to path, as other workers may at the
+ * same time */
+static int make_dirs(char *path)
+{
+	for (char *slash = strchr(path + 1, '/'); slash;
+			slash = strchr(slash + 1, '/')) {
+		*slash = 0;
+
+		int r = mkdir(path, 0777);
+
+		*slash = '/';
+
+		if (r < 0 && errno != EEXIST) {
+			perror(path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Outputs are written next to the input, or under -o out-dir at the
+ * input's path as given, so that inputs of the same name in different
+ * directories do not share an output. Components of the path that lead
+ * out of the directory are renamed. Each capture of a file after the
+ * first adds its number to the name. */
+static int output_path(struct worker *w, char *path, size_t size,
+		const char *ext, int numbered)
+{
+	const char *in = w->input;
+	size_t len = 0;
+	int n;
+
+	if (w->conv->out_dir) {
+		n = snprintf(path, size, "%s/", w->conv->out_dir);
+
+		if (n < 0 || (size_t) n >= size) {
+			goto too_long;
+		}
+
+		len = n;
+
+		while (*in == '/') {
+			in++;
+		}
+
+		while (*in) {
+			const char *end = strchr(in, '/');
+			size_t part = end ? (size_t) (end - in) : strlen(in);
+			int up = part == 2 && in[0] == '.' && in[1] == '.';
+
+			n = snprintf(path + len, size - len, "%.*s%s", (int) part,
+					up ? "__" : in, end ? "/" : "");
+
+			if (n < 0 || (size_t) n >= size - len) {
+				goto too_long;
+			}
+
+			len += n;
+			in += part + (end ? 1 : 0);
+		}
+	} else {
+		n = snprintf(path, size, "%s", in);
+
+		if (n < 0 || (size_t) n >= size) {
+			goto too_long;
+		}
+
+		len = n;
+	}
+
+	if (numbered && w->capture > 1) {
+		n = snprintf(path + len, size - len, "-%d.%s", w->capture, ext);
+	} else {
+		n = snprintf(path + len, size - len, ".%s", ext);
+	}
+
+	if (n < 0 || (size_t) n >= size - len) {
+		goto too_long;
+	}
+
+	if (w->conv->out_dir && make_dirs(path) < 0) {
+		return -1;
+	}
+
+	return 0;
+too_long:
+	fprintf(stderr, "%s: path too long\n", w->input);
+	return -1;
+}
+
+static FILE *open_output(struct worker *w, const char *ext, int numbered)
+{
+	char path [PATH_MAX];
+
+	if (output_path(w, path, sizeof(path), ext, numbered) < 0) {
+		return 0;
+	}
+
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		perror(path);
+		return 0;
+	}
+
+	return f;
+}
+
+static void capture_begin(struct worker *w)
+{
+	struct convert *conv = w->conv;
+
+	w->capture++;
+
+	if (conv->formats & FORMAT_SVG) {
+		if ((w->svg.out = open_output(w, "svg", 1))) {
+			setvbuf(w->svg.out, w->out_buf, _IOFBF, OUT_BUF_SIZE);
+		} else {
+			atomic_fetch_add(&conv->failures, 1);
+		}
+	}
+
+	if (conv->formats & FORMAT_PNG) {
+		persist_init(w->persist);
+	}
+
+	if (conv->formats & FORMAT_CSV) {
+		if (!w->csv && w->capture == 1) {
+			if ((w->csv = open_output(w, "csv", 0))) {
+				measure_write_csv_header(w->csv);
+			} else {
+				atomic_fetch_add(&conv->failures, 1);
+			}
+		}
+
+		measure_init(&w->measure);
+	}
+}
+
+static void capture_end(struct worker *w)
+{
+	struct convert *conv = w->conv;
+	char path [PATH_MAX];
+
+	if (w->svg.out) {
+		fclose(w->svg.out);
+		w->svg.out = 0;
+	}
+
+	if ((conv->formats & FORMAT_PNG) &&
+			(output_path(w, path, sizeof(path), "png", 1) < 0 ||
+			persist_write_png(w->persist, path) < 0)) {
+		atomic_fetch_add(&conv->failures, 1);
+	}
+
+	if (w->csv) {
+		measure_write_csv(w->csv, &w->measure, w->capture);
+	}
+}
+
+static void worker_op(void *ctx, const struct op *op)
+{
+	struct worker *w = ctx;
+	int formats = w->conv->formats;
+
+	if (op->code == OP_BEGIN) {
+		if (w->in_capture) {
+			struct op end = {OP_END, {0}, 0, 0, 0};
+
+			fprintf(stderr, "%s: capture %d is incomplete\n", w->input,
+					w->capture);
+			worker_op(w, &end);
+		}
+
+		capture_begin(w);
+		w->in_capture = 1;
+	} else if (!w->in_capture) {
+		return;
+	}
+
+	if (w->svg.out) {
+		svg_op(&w->svg, op);
+	}
+
+	if (formats & FORMAT_PNG) {
+		persist_op(w->persist, op);
+	}
+
+	if (formats & FORMAT_CSV) {
+		measure_op(&w->measure, op);
+	}
+
+	if (op->code == OP_END) {
+		capture_end(w);
+		w->in_capture = 0;
+	}
+}
+
+static int convert_file(struct worker *w, const char *path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+
+		if (fd >= 0) {
+			close(fd);
+		}
+
+		return -1;
+	}
+
+	w->input = path;
+	w->capture = 0;
+	w->in_capture = 0;
+	w->csv = 0;
+
+	svg_init(&w->svg, 0);
+	op_decoder_init(&w->dec, worker_op, w);
+	raw_init(&w->raw, &w->dec);
+
+	if (st.st_size > 0) {
+		void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (data == MAP_FAILED) {
+			perror(path);
+			close(fd);
+			return -1;
+		}
+
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		raw_feed(&w->raw, data, st.st_size);
+		munmap(data, st.st_size);
+	}
+
+	close(fd);
+
+	if (w->in_capture) {
+		struct op end = {OP_END, {0}, 0, 0, 0};
+
+		fprintf(stderr, "%s: capture %d is incomplete\n", path, w->capture);
+		worker_op(w, &end);
+	}
+
+	if (w->csv && fclose(w->csv)) {
+		perror(path);
+		w->csv = 0;
+		return -1;
+	}
+
+	w->csv = 0;
+
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	size_t index;
+
+	while (take_file(w->conv, w->id, &index)) {
+		if (convert_file(w, w->conv->files.paths[index]) < 0) {
+			atomic_fetch_add(&w->conv->failures, 1);
+		}
+	}
+
+	return 0;
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: dsoctl convert [-j jobs] [-o out-dir] "
+			"[-t svg,png,csv] path...\n");
+	fprintf(stderr, "Converts raw HPGL captures to SVG, or to the formats "
+			"listed with -t: SVG or PNG\nimages of each capture, and a CSV "
+			"of the measurements of each file's captures.\nPaths may be "
+			"files, directories, which are searched for .hpgl and .plt "
+			"files,\nor globs. Under -o out-dir, outputs keep the paths of "
+			"their inputs.\n");
+}
+
+static int parse_formats(const char *arg)
+{
+	static const char *names [] = {"svg", "png", "csv"};
+	int formats = 0;
+
+	while (*arg) {
+		size_t len = strcspn(arg, ",");
+		size_t i;
+
+		for (i = 0; i < sizeof(names) / sizeof(*names); i++) {
+			if (len == strlen(names[i]) && strncmp(arg, names[i], len) == 0) {
+				formats |= 1 << i;
+				break;
+			}
+		}
+
+		if (i == sizeof(names) / sizeof(*names)) {
+			return 0;
+		}
+
+		arg += len + (arg[len] == ',');
+	}
+
+	return formats;
+}
+
+int convert_main(int argc, char *argv[])
+{
+	struct convert conv = {.formats = FORMAT_SVG};
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	int r = 0;
+
+	optind = 1;
+
+	while ((opt = getopt(argc, argv, "j:o:t:")) != -1) {
+		switch (opt) {
+		case 'j':
+			jobs = atol(optarg);
+			break;
+		case 'o':
+			conv.out_dir = optarg;
+			break;
+		case 't':
+			if (!(conv.formats = parse_formats(optarg))) {
+				usage();
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind == argc || jobs < 1) {
+		usage();
+		return 1;
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (add_arg(&conv.files, argv[i]) < 0) {
+			r = 1;
+			goto exit;
+		}
+	}
+
+	remove_duplicates(&conv.files);
+
+	if ((size_t) jobs > conv.files.count) {
+		jobs = conv.files.count ? conv.files.count : 1;
+	}
+
+	conv.worker_count = jobs;
+	conv.shares = calloc(jobs, sizeof(*conv.shares));
+	atomic_init(&conv.failures, 0);
+
+	struct worker *workers = calloc(jobs, sizeof(*workers));
+
+	if (!conv.shares || !workers) {
+		fprintf(stderr, "Out of memory\n");
+		free(workers);
+		r = 1;
+		goto exit;
+	}
+
+	for (int i = 0; i < jobs; i++) {
+		atomic_init(&conv.shares[i].next, conv.files.count * i / jobs);
+		conv.shares[i].end = conv.files.count * (i + 1) / jobs;
+	}
+
+	int started = 0;
+
+	for (int i = 0; i < jobs; i++) {
+		workers[i].conv = &conv;
+		workers[i].id = i;
+
+		if ((conv.formats & FORMAT_PNG) &&
+				!(workers[i].persist = malloc(sizeof(*workers[i].persist)))) {
+			fprintf(stderr, "Out of memory\n");
+			r = 1;
+			break;
+		}
+
+		if (!(workers[i].out_buf = malloc(OUT_BUF_SIZE)) ||
+				pthread_create(&workers[i].thread, 0, worker_main,
+					&workers[i])) {
+			fprintf(stderr, "Failed to start worker\n");
+			free(workers[i].out_buf);
+			free(workers[i].persist);
+			r = 1;
+			break;
+		}
+
+		started++;
+	}
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, 0);
+		free(workers[i].out_buf);
+		free(workers[i].persist);
+	}
+
+	free(workers);
+
+	if (atomic_load(&conv.failures)) {
+		r = 1;
+	}
+
+exit:
+	for (size_t i = 0; i < conv.files.count; i++) {
+		free(conv.files.paths[i]);
+	}
+
+	free(conv.files.paths);
+	free(conv.shares);
+
+	return r;
+}
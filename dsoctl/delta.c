@@ -0,0 +1,415 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "delta.h"
+#include "common.h"
+#include "ops.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Shorter matches cost more as a copy than as literal bytes */
+#define DELTA_MIN_COPY 8
+
+enum {
+	DELTA_LITERAL,
+	DELTA_COPY,
+};
+
+void delta_init(struct delta *d)
+{
+	memset(d, 0, sizeof(*d));
+	d->base_mode = -1;
+}
+
+void delta_free(struct delta *d)
+{
+	free(d->base);
+	free(d->prims);
+	free(d->table);
+	free(d->out);
+	delta_init(d);
+}
+
+void delta_reset(struct delta *d)
+{
+	d->base_length = 0;
+	d->base_mode = -1;
+	d->prim_count = 0;
+}
+
+/* FNV-1a */
+static uint64_t hash(const uint8_t *data, uint32_t length)
+{
+	uint64_t h = 0xcbf29ce484222325;
+
+	for (uint32_t i = 0; i < length; i++) {
+		h = (h ^ data[i]) * 0x100000001b3;
+	}
+
+	return h;
+}
+
+static uint32_t prim_length(int mode, const uint8_t *data, uint32_t length)
+{
+	uint32_t n = 0;
+
+	if (mode == MODE_RAW) {
+		while (n < length) {
+			uint8_t c = data[n++];
+
+			if (c == ';' || c == 0x03) {
+				break;
+			}
+		}
+
+		return n;
+	}
+
+	if (data[0] != OP_LABEL) {
+		return MIN(op_size(data, MIN(length, 255)), length);
+	}
+
+	/* A label is kept together with its text */
+	n = MIN(op_size(data, 1), length);
+
+	while (n < length && data[n] >= OP_TEXT) {
+		n++;
+	}
+
+	if (n < length && data[n] == OP_LABEL_END) {
+		n++;
+	}
+
+	return n;
+}
+
+static int grow(void **buf, size_t *size, size_t need, size_t elem)
+{
+	if (need <= *size) {
+		return 0;
+	}
+
+	size_t size_new = *size ? *size : 64;
+
+	while (size_new < need) {
+		size_new *= 2;
+	}
+
+	void *p = realloc(*buf, size_new * elem);
+
+	if (!p) {
+		return -1;
+	}
+
+	*buf = p;
+	*size = size_new;
+
+	return 0;
+}
+
+static int prim_equal(const struct delta *d, const struct delta_prim *p,
+		uint64_t h, const uint8_t *data, uint32_t length)
+{
+	return p->hash == h && p->length == length &&
+		memcmp(d->base + p->offset, data, length) == 0;
+}
+
+/* Index of a primitive of the previous capture equal to data, or -1 */
+static long lookup(const struct delta *d, uint64_t h, const uint8_t *data,
+		uint32_t length)
+{
+	if (!d->prim_count) {
+		return -1;
+	}
+
+	size_t mask = d->table_size - 1;
+
+	for (size_t i = h & mask; d->table[i]; i = (i + 1) & mask) {
+		const struct delta_prim *p = &d->prims[d->table[i] - 1];
+
+		if (prim_equal(d, p, h, data, length)) {
+			return d->table[i] - 1;
+		}
+	}
+
+	return -1;
+}
+
+/* Takes a copy of the capture and its fingerprint for the next one. Of
+ * equal primitives, the table keeps the first. */
+int delta_set_base(struct delta *d, int mode, const uint8_t *data,
+		uint32_t length)
+{
+	delta_reset(d);
+
+	if (grow((void **) &d->base, &d->base_size, length, 1) < 0) {
+		return -1;
+	}
+
+	memcpy(d->base, data, length);
+
+	for (uint32_t offset = 0; offset < length; ) {
+		uint32_t n = prim_length(mode, data + offset, length - offset);
+
+		if (grow((void **) &d->prims, &d->prim_size, d->prim_count + 1,
+				sizeof(*d->prims)) < 0) {
+			return -1;
+		}
+
+		d->prims[d->prim_count++] = (struct delta_prim) {
+			hash(data + offset, n), offset, n
+		};
+		offset += n;
+	}
+
+	size_t table_size = 64;
+
+	while (table_size < d->prim_count * 2) {
+		table_size *= 2;
+	}
+
+	if (table_size > d->table_size) {
+		free(d->table);
+		d->table_size = 0;
+
+		if (!(d->table = malloc(table_size * sizeof(*d->table)))) {
+			d->prim_count = 0;
+			return -1;
+		}
+
+		d->table_size = table_size;
+	}
+
+	memset(d->table, 0, d->table_size * sizeof(*d->table));
+
+	size_t mask = d->table_size - 1;
+
+	for (size_t n = 0; n < d->prim_count; n++) {
+		const struct delta_prim *p = &d->prims[n];
+		size_t i = p->hash & mask;
+
+		while (d->table[i] &&
+				!prim_equal(d, &d->prims[d->table[i] - 1], p->hash,
+				d->base + p->offset, p->length)) {
+			i = (i + 1) & mask;
+		}
+
+		if (!d->table[i]) {
+			d->table[i] = n + 1;
+		}
+	}
+
+	d->base_length = length;
+	d->base_mode = mode;
+
+	return 0;
+}
+
+static int put_varint(struct delta *d, uint64_t v)
+{
+	if (grow((void **) &d->out, &d->out_size, d->out_length + 10, 1) < 0) {
+		return -1;
+	}
+
+	do {
+		d->out[d->out_length++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		v >>= 7;
+	} while (v);
+
+	return 0;
+}
+
+static int put_literal(struct delta *d, const uint8_t *data, uint32_t length)
+{
+	if (!length) {
+		return 0;
+	}
+
+	if (put_varint(d, (uint64_t) length << 1 | DELTA_LITERAL) < 0 ||
+			grow((void **) &d->out, &d->out_size,
+			d->out_length + length, 1) < 0) {
+		return -1;
+	}
+
+	memcpy(d->out + d->out_length, data, length);
+	d->out_length += length;
+
+	return 0;
+}
+
+int delta_encode(struct delta *d, int mode, const uint8_t *data,
+		uint32_t length)
+{
+	uint32_t literal = 0;
+	uint32_t copy_start = 0;
+	uint32_t copy_offset = 0;
+	uint32_t copy_length = 0;
+	long next = -1;
+
+	/* A base of another mode is kept, for if this capture is not stored */
+	int base = mode == d->base_mode;
+
+	d->out_length = 0;
+
+	if (put_varint(d, length) < 0) {
+		return -1;
+	}
+
+	for (uint32_t offset = 0; offset <= length; ) {
+		uint32_t n = 0;
+		long match;
+
+		if (offset < length) {
+			n = prim_length(mode, data + offset, length - offset);
+		}
+
+		/* The primitive after the last match is the likeliest */
+		if (offset == length || !base) {
+			match = -1;
+		} else if (next >= 0 && (size_t) next < d->prim_count &&
+				d->prims[next].length == n &&
+				memcmp(d->base + d->prims[next].offset, data + offset,
+				n) == 0) {
+			match = next;
+		} else {
+			match = lookup(d, hash(data + offset, n), data + offset, n);
+		}
+
+		if (match >= 0 && copy_length &&
+				d->prims[match].offset == copy_offset + copy_length) {
+			copy_length += n;
+		} else {
+			if (copy_length >= DELTA_MIN_COPY) {
+				if (put_literal(d, data + literal, copy_start - literal) < 0 ||
+						put_varint(d, (uint64_t) copy_length << 1 |
+						DELTA_COPY) < 0 || put_varint(d, copy_offset) < 0) {
+					return -1;
+				}
+
+				literal = copy_start + copy_length;
+			}
+
+			copy_length = 0;
+
+			if (match >= 0) {
+				copy_start = offset;
+				copy_offset = d->prims[match].offset;
+				copy_length = n;
+			}
+		}
+
+		next = match >= 0 ? match + 1 : -1;
+
+		if (offset == length) {
+			break;
+		}
+
+		offset += n;
+	}
+
+	if (put_literal(d, data + literal, length - literal) < 0) {
+		return -1;
+	}
+
+	return d->out_length < length;
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	*v = 0;
+
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (*p == end) {
+			return -1;
+		}
+
+		uint8_t c = *(*p)++;
+
+		*v |= (uint64_t) (c & 0x7f) << shift;
+
+		if (!(c & 0x80)) {
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+uint8_t *delta_decode(const uint8_t *base, uint32_t base_length,
+		const uint8_t *data, uint32_t length, uint32_t *out_length)
+{
+	const uint8_t *p = data;
+	const uint8_t *end = data + length;
+	uint64_t total;
+	uint64_t n = 0;
+
+	if (get_varint(&p, end, &total) < 0 || total > UINT32_MAX) {
+		return 0;
+	}
+
+	uint8_t *out = malloc(total ? total : 1);
+
+	if (!out) {
+		return 0;
+	}
+
+	while (p < end) {
+		uint64_t v;
+		uint64_t offset;
+
+		if (get_varint(&p, end, &v) < 0) {
+			break;
+		}
+
+		uint64_t len = v >> 1;
+
+		if (len > total - n) {
+			break;
+		}
+
+		if ((v & 1) == DELTA_COPY) {
+			if (get_varint(&p, end, &offset) < 0 || offset > base_length ||
+					len > base_length - offset) {
+				break;
+			}
+
+			memcpy(out + n, base + offset, len);
+		} else {
+			if (len > (uint64_t) (end - p)) {
+				break;
+			}
+
+			memcpy(out + n, p, len);
+			p += len;
+		}
+
+		n += len;
+	}
+
+	if (p != end || n != total) {
+		free(out);
+		return 0;
+	}
+
+	*out_length = total;
+
+	return out;
+}
@@ -0,0 +1,80 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Differential encoding of a capture against the one before it, for
+ * repeated captures of a mostly unchanged screen.
+ *
+ * A capture is split into primitives: single drawing operations or whole
+ * labels for MODE_CONVERT, and HPGL instructions for MODE_RAW. The
+ * fingerprint of the previous capture maps the hash of each of its
+ * primitives to where it was, and runs of primitives found there become
+ * copies. The encoding is the length of the capture followed by a sequence
+ * of copies of byte ranges of the previous capture and literal bytes, so
+ * reconstruction is exact whatever the hashes. */
+struct delta_prim {
+	uint64_t hash;
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct delta {
+	uint8_t *base;
+	uint32_t base_length;
+	size_t base_size;
+	int base_mode;
+	struct delta_prim *prims;
+	size_t prim_count;
+	size_t prim_size;
+	uint32_t *table; /* open addressing, primitive index + 1 */
+	size_t table_size;
+	uint8_t *out;
+	size_t out_length;
+	size_t out_size;
+};
+
+void delta_init(struct delta *d);
+void delta_free(struct delta *d);
+
+/* Forgets the previous capture, so that the next is stored whole */
+void delta_reset(struct delta *d);
+
+/* Encodes a capture against the base into out, leaving the base as it is.
+ * Returns 1 if the encoding is smaller than the capture, 0 if it should be
+ * stored whole or -1 if out of memory. */
+int delta_encode(struct delta *d, int mode, const uint8_t *data,
+		uint32_t length);
+
+/* Makes a capture the base of the next, once it has been stored. Returns -1
+ * if out of memory, leaving no base. */
+int delta_set_base(struct delta *d, int mode, const uint8_t *data,
+		uint32_t length);
+
+/* Reconstructs a capture from its encoding and the previous capture,
+ * returning it in a buffer to be freed by the caller, or 0 if the encoding
+ * is corrupt */
+uint8_t *delta_decode(const uint8_t *base, uint32_t base_length,
+		const uint8_t *data, uint32_t length, uint32_t *out_length);
+
+#endif /* DELTA_H */
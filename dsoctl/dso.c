@@ -0,0 +1,451 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "dso.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Transfers are of one packet of the IN endpoint, as the frame decoder
+ * drops the rest of a transfer that turns out to be corrupt */
+#define DSO_TRANSFER 8
+
+/* How often the receiving thread checks whether it is to stop */
+#define DSO_POLL_MS 100
+
+static const char *errors [] = {
+	[DSO_ERROR_USB] = "USB transfer failed",
+	[DSO_ERROR_TIMEOUT] = "Timed out",
+	[DSO_ERROR_NO_DEVICE] = "No device found",
+	[DSO_ERROR_IO] = "Failed to read the recording",
+	[DSO_ERROR_FORMAT] = "Not a recording or truncated",
+	[DSO_ERROR_MEMORY] = "Out of memory",
+	[DSO_ERROR_REQUEST] = "The device did not take the request",
+	[DSO_ERROR_END] = "The replay ended before the reply",
+	[DSO_ERROR_BUSY] = "Already receiving",
+};
+
+const char *dso_strerror(int error)
+{
+	error = -error;
+
+	if (error <= 0 || error >= (int) (sizeof(errors) / sizeof(*errors))) {
+		return "Unknown error";
+	}
+
+	return errors[error];
+}
+
+int dso_format_warning(char *buf, size_t size, const struct dso_warning *w)
+{
+	const unsigned *a = w->arg;
+
+	switch (w->type) {
+	case DSO_WARNING_CORRUPT:
+		return snprintf(buf, size, "Packet %u failed CRC check", a[0]);
+	case DSO_WARNING_LOST:
+		return snprintf(buf, size, "Lost %u packets before packet %u", a[0],
+				a[1]);
+	case DSO_WARNING_START_LOST:
+		return snprintf(buf, size, "Start of capture %u was lost", a[0]);
+	case DSO_WARNING_SHORT:
+		return snprintf(buf, size, "Capture %u: received %u of %u bytes",
+				a[0], a[1], a[2]);
+	case DSO_WARNING_DATA_DROPPED:
+		return snprintf(buf, size, "Out of memory, data of capture %u "
+				"dropped", a[0]);
+	case DSO_WARNING_TRACE_ORDER:
+		return snprintf(buf, size, "Trace dump packet out of order");
+	}
+
+	return snprintf(buf, size, "Unknown warning %d", w->type);
+}
+
+static void warn(struct dso *d, int type, unsigned a, unsigned b, unsigned c)
+{
+	const struct dso_warning w = {type, {a, b, c}};
+
+	if (d->cb.warning) {
+		d->cb.warning(d->cb.ctx, &w);
+	}
+}
+
+static void on_frame_error(void *ctx, int error, unsigned count, uint8_t seq)
+{
+	struct dso *d = ctx;
+
+	if (error == FRAME_CORRUPT) {
+		warn(d, DSO_WARNING_CORRUPT, seq, 0, 0);
+	} else {
+		warn(d, DSO_WARNING_LOST, count, seq, 0);
+	}
+}
+
+static void capture_data(struct dso *d, const uint8_t *data, size_t len)
+{
+	if (!d->keep_data) {
+		return;
+	}
+
+	if (d->data_len + len > d->data_size) {
+		size_t size = d->data_size ? d->data_size * 2 : 4096;
+		uint8_t *buf;
+
+		while (size < d->data_len + len) {
+			size *= 2;
+		}
+
+		if (!(buf = realloc(d->data, size))) {
+			if (!(d->flags & DSO_CAPTURE_INCOMPLETE)) {
+				warn(d, DSO_WARNING_DATA_DROPPED, d->capture_id, 0, 0);
+			}
+
+			d->flags |= DSO_CAPTURE_INCOMPLETE;
+			return;
+		}
+
+		d->data = buf;
+		d->data_size = size;
+	}
+
+	memcpy(d->data + d->data_len, data, len);
+	d->data_len += len;
+}
+
+static void capture_done(struct dso *d, uint16_t id)
+{
+	struct dso_capture capture = {
+		.id = id,
+		.mode = d->mode,
+		.flags = d->flags,
+		.data = d->data,
+		.len = d->data_len,
+	};
+
+	d->captures++;
+
+	if (d->cb.capture) {
+		d->cb.capture(d->cb.ctx, &capture);
+	}
+
+	d->data_len = 0;
+	d->flags = 0;
+}
+
+static void on_op(void *ctx, const struct op *op)
+{
+	struct dso *d = ctx;
+
+	if (op->code == OP_END) {
+		d->plot_end = 1;
+	}
+
+	if (d->cb.op) {
+		d->cb.op(d->cb.ctx, op);
+	}
+}
+
+static void store_entry(struct dso *d,
+		const struct usb_packet_store_entry *entry)
+{
+	struct dso_store_list *list = &d->store;
+
+	list->total = entry->total;
+
+	if (entry->index < list->max && entry->total) {
+		list->entries[entry->index] = (struct dso_stored) {
+			.seq = entry->capture_seq,
+			.id = entry->id,
+			.stored = entry->stored,
+			.bytes = entry->bytes,
+		};
+	}
+
+	if (entry->index + 1 >= entry->total) {
+		list->complete = 1;
+	}
+}
+
+static void on_packet(void *ctx, const union usb_packet_in *packet, int gap)
+{
+	struct dso *d = ctx;
+	const uint8_t *payload = packet->data + USB_PACKET_HEADER;
+	size_t len = packet->any.length - USB_PACKET_HEADER;
+
+	if (gap) {
+		op_decoder_reset(&d->dec);
+		d->flags |= DSO_CAPTURE_INCOMPLETE;
+	}
+
+	if (d->cb.packet) {
+		d->cb.packet(d->cb.ctx, packet, gap);
+	}
+
+	switch (packet->any.type) {
+	case USB_PACKET_CAPTURE_BEGIN:
+		d->in_capture = 1;
+		d->capture_id = packet->capture_begin.id;
+		d->capture_bytes = 0;
+		d->data_len = 0;
+		d->flags = 0;
+		break;
+	case USB_PACKET_LOG:
+		d->capture_bytes += len;
+		capture_data(d, payload, len);
+		op_decoder_feed(&d->dec, payload, len);
+		break;
+	case USB_PACKET_RAW:
+		/* Fed a byte at a time so that captures split at the end of each
+		 * plot */
+		for (size_t i = 0; i < len; i++) {
+			capture_data(d, payload + i, 1);
+			raw_feed(&d->raw, payload + i, 1);
+
+			if (d->plot_end) {
+				d->plot_end = 0;
+				capture_done(d, d->captures + 1);
+			}
+		}
+		break;
+	case USB_PACKET_RAW_RESYNC:
+		d->flags |= DSO_CAPTURE_INCOMPLETE;
+		raw_resync(&d->raw);
+		break;
+	case USB_PACKET_CAPTURE_END:
+		if (!d->in_capture || packet->capture_end.id != d->capture_id) {
+			warn(d, DSO_WARNING_START_LOST, packet->capture_end.id, 0, 0);
+			d->flags |= DSO_CAPTURE_INCOMPLETE;
+		} else if (packet->capture_end.bytes != d->capture_bytes) {
+			warn(d, DSO_WARNING_SHORT, d->capture_id, d->capture_bytes,
+					packet->capture_end.bytes);
+			d->flags |= DSO_CAPTURE_INCOMPLETE;
+		}
+
+		d->in_capture = 0;
+		capture_done(d, packet->capture_end.id);
+		break;
+	case USB_PACKET_TRACE:
+		if (trace_dump_packet(&d->trace, &packet->trace) < 0) {
+			warn(d, DSO_WARNING_TRACE_ORDER, 0, 0, 0);
+		}
+		break;
+	case USB_PACKET_STORE_ENTRY:
+		store_entry(d, &packet->store_entry);
+		break;
+	}
+}
+
+void dso_init(struct dso *d, struct dso_transport *transport,
+		const struct dso_callbacks *cb)
+{
+	memset(d, 0, sizeof(*d));
+	d->transport = transport;
+	d->mode = MODE_CONVERT;
+
+	if (cb) {
+		d->cb = *cb;
+	}
+
+	op_decoder_init(&d->dec, on_op, d);
+	raw_init(&d->raw, &d->dec);
+	frame_decoder_init(&d->frame, on_packet, d);
+	d->frame.error = on_frame_error;
+}
+
+void dso_free(struct dso *d)
+{
+	dso_stop(d);
+	free(d->data);
+	d->data = 0;
+	d->data_len = d->data_size = 0;
+}
+
+int dso_set_mode(struct dso *d, uint8_t mode)
+{
+	int r = d->transport->request(d->transport, USB_REQ_SET_MODE, mode);
+
+	if (r < 0) {
+		return -DSO_ERROR_REQUEST;
+	}
+
+	d->mode = mode;
+
+	return 0;
+}
+
+/* Has the device plot synthetic captures at rate bytes per millisecond, or
+ * as fast as possible for 0 */
+int dso_generate(struct dso *d, uint8_t captures, uint8_t rate)
+{
+	int r = d->transport->request(d->transport, USB_REQ_GENERATE,
+			captures | rate << 8);
+
+	if (r < 0) {
+		return -DSO_ERROR_REQUEST;
+	}
+
+	return 0;
+}
+
+/* Returns the number of bytes received, 0 at the end of a replay or a
+ * negative error */
+int dso_receive(struct dso *d, unsigned timeout)
+{
+	uint8_t buf [DSO_TRANSFER];
+	int r = d->transport->read(d->transport, buf, sizeof(buf), timeout);
+
+	if (r <= 0) {
+		return r;
+	}
+
+	d->bytes += r;
+	frame_decoder_feed(&d->frame, buf, r);
+
+	return r;
+}
+
+/* Asks the device for its trace ring, which is collected in d->trace */
+int dso_dump_trace(struct dso *d, unsigned timeout)
+{
+	int r = d->transport->request(d->transport, USB_REQ_TRACE, 0);
+
+	if (r < 0) {
+		return -DSO_ERROR_REQUEST;
+	}
+
+	trace_dump_init(&d->trace);
+
+	while (!d->trace.complete) {
+		if ((r = dso_receive(d, timeout)) <= 0) {
+			return r ? r : -DSO_ERROR_END;
+		}
+	}
+
+	return 0;
+}
+
+/* Has the device store captures in its flash instead of sending them, so
+ * that they are kept while nothing reads the adapter, or send them again */
+int dso_store(struct dso *d, int enable)
+{
+	int r = d->transport->request(d->transport, USB_REQ_STORE, enable != 0);
+
+	if (r < 0) {
+		return -DSO_ERROR_REQUEST;
+	}
+
+	return 0;
+}
+
+/* Lists the captures stored on the device, oldest first, into up to max
+ * entries. Returns the number of captures stored, which may be more than
+ * max, or a negative error. */
+int dso_store_list(struct dso *d, struct dso_stored *entries, int max,
+		unsigned timeout)
+{
+	int r = d->transport->request(d->transport, USB_REQ_STORE_LIST, 0);
+
+	if (r < 0) {
+		return -DSO_ERROR_REQUEST;
+	}
+
+	d->store = (struct dso_store_list) {.entries = entries, .max = max};
+
+	while (!d->store.complete) {
+		if ((r = dso_receive(d, timeout)) <= 0) {
+			return r ? r : -DSO_ERROR_END;
+		}
+	}
+
+	return d->store.total;
+}
+
+/* Has the device send a stored capture, which is passed to the callbacks
+ * like a live one in MODE_CONVERT. Returns 1 if the capture is no longer
+ * stored. */
+int dso_store_fetch(struct dso *d, uint32_t seq, unsigned timeout)
+{
+	int captures = d->captures;
+	int r = d->transport->request(d->transport, USB_REQ_STORE_FETCH,
+			seq & 0xFFFF);
+
+	if (r < 0) {
+		return -DSO_ERROR_REQUEST;
+	}
+
+	d->store = (struct dso_store_list) {0};
+
+	while (d->captures == captures) {
+		if (d->store.complete) {
+			return 1;
+		}
+
+		if ((r = dso_receive(d, timeout)) <= 0) {
+			return r ? r : -DSO_ERROR_END;
+		}
+	}
+
+	return 0;
+}
+
+static void *receive_thread(void *arg)
+{
+	struct dso *d = arg;
+	int r;
+
+	do {
+		r = dso_receive(d, DSO_POLL_MS);
+	} while (!d->stop && (r > 0 || r == -DSO_ERROR_TIMEOUT));
+
+	if (d->cb.done) {
+		d->cb.done(d->cb.ctx, d->stop || r == 0 ? 0 : r);
+	}
+
+	return 0;
+}
+
+int dso_start(struct dso *d)
+{
+	if (d->running) {
+		return -DSO_ERROR_BUSY;
+	}
+
+	d->stop = 0;
+
+	if (pthread_create(&d->thread, 0, receive_thread, d)) {
+		return -DSO_ERROR_MEMORY;
+	}
+
+	d->running = 1;
+
+	return 0;
+}
+
+/* Waits for the receiving thread to finish the transfer it is reading,
+ * then for the done callback */
+void dso_stop(struct dso *d)
+{
+	if (!d->running) {
+		return;
+	}
+
+	d->stop = 1;
+	pthread_join(d->thread, 0);
+	d->running = 0;
+}
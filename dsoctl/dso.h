@@ -0,0 +1,233 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef DSO_H
+#define DSO_H
+
+#include "common.h"
+#include "frame.h"
+#include "ops.h"
+#include "raw.h"
+#include "trace.h"
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* libdso475: receives captures from an adapter in-process. A struct dso
+ * holds all state of one adapter, so any number can be used at once, and
+ * reads its input through a transport: the adapter over libusb, a recording
+ * of the adapter's IN endpoint replayed from a file, or a buffer in memory.
+ *
+ * dso_receive() reads one transfer and passes what it completes to the
+ * callbacks: every packet, every drawing operation and, at the end of each
+ * capture, the capture's data as received. dso_start() does the same on a
+ * thread of its own, calling the callbacks from there as data arrives.
+ *
+ * The library prints nothing. Functions return the errors below, negated,
+ * and problems with the data received are passed to the warning callback. */
+
+enum {
+	DSO_ERROR_USB = 1,   /* libusb failed, as when the adapter is unplugged */
+	DSO_ERROR_TIMEOUT,   /* nothing was received within the timeout */
+	DSO_ERROR_NO_DEVICE, /* no adapter is connected */
+	DSO_ERROR_IO,        /* a file could not be read; errno is set */
+	DSO_ERROR_FORMAT,    /* a recording is truncated or not a capture */
+	DSO_ERROR_MEMORY,    /* out of memory */
+	DSO_ERROR_REQUEST,   /* the adapter did not take a vendor request */
+	DSO_ERROR_END,       /* a replay ended before the reply to a request */
+	DSO_ERROR_BUSY,      /* the receiving thread is already running */
+};
+
+const char *dso_strerror(int error);
+
+struct dso_transport {
+	/* Reads at most len bytes. Returns the number read, 0 at the end of a
+	 * replay or a negative error. */
+	int (*read)(struct dso_transport *t, uint8_t *buf, size_t len,
+			unsigned timeout);
+	int (*request)(struct dso_transport *t, uint8_t request, uint16_t value);
+	void (*close)(struct dso_transport *t);
+	char serial [32];
+};
+
+struct dso_usb {
+	struct dso_transport transport;
+	struct libusb_context *context;
+	struct libusb_device_handle *handle;
+	int claimed;
+};
+
+struct dso_file {
+	struct dso_transport transport;
+	FILE *file;
+};
+
+/* Replays the adapter's bulk IN transfers from a usbmon capture in pcap or
+ * pcapng format, as fast as possible or with their original timing. The
+ * device is the first one seen completing a transfer on endpoint 0x82. */
+#define DSO_PCAP_INTERFACES 8
+
+struct dso_pcap {
+	struct dso_transport transport;
+	FILE *file;
+	int pcapng;
+	int swapped;
+	int realtime;
+
+	/* Link type and timestamp units per second of each interface; a pcap
+	 * file has just one */
+	int interfaces;
+	uint16_t linktype [DSO_PCAP_INTERFACES];
+	uint64_t ts_units [DSO_PCAP_INTERFACES];
+
+	int devnum;
+	double first_ts;
+	double first_time;
+
+	uint8_t *block;
+	size_t block_size;
+	const uint8_t *data;
+	size_t len;
+};
+
+/* Replays a buffer as the file transport does, and records the
+ * last vendor request, for testing clients without an adapter */
+struct dso_mem {
+	struct dso_transport transport;
+	const uint8_t *data;
+	size_t len;
+	size_t pos;
+	uint8_t request;
+	uint16_t value;
+};
+
+int dso_usb_open(struct dso_usb *usb);
+int dso_file_open(struct dso_file *file, const char *path);
+int dso_pcap_is_capture(const char *path);
+int dso_pcap_open(struct dso_pcap *pcap, const char *path, int realtime);
+void dso_mem_init(struct dso_mem *mem, const void *data, size_t len);
+
+enum {
+	DSO_CAPTURE_INCOMPLETE = 1, /* data was lost, as ARCHIVE_INCOMPLETE */
+};
+
+struct dso_capture {
+	uint16_t id;
+	uint8_t mode;
+	uint8_t flags;
+	const uint8_t *data; /* only kept when keep_data is set */
+	size_t len;
+};
+
+/* Problems with the data received, after which receiving goes on. The
+ * arguments of each are given in order. */
+enum {
+	DSO_WARNING_CORRUPT,      /* packet seq failed its CRC check */
+	DSO_WARNING_LOST,         /* count packets lost before packet seq */
+	DSO_WARNING_START_LOST,   /* the start of capture id was lost */
+	DSO_WARNING_SHORT,        /* capture id: received of bytes arrived */
+	DSO_WARNING_DATA_DROPPED, /* out of memory for the data of capture id */
+	DSO_WARNING_TRACE_ORDER,  /* a trace dump packet arrived out of order */
+};
+
+struct dso_warning {
+	int type;
+	unsigned arg [3];
+};
+
+/* Describes a warning as dsoctl prints it, without a newline */
+int dso_format_warning(char *buf, size_t size, const struct dso_warning *w);
+
+struct dso_callbacks {
+	frame_func packet;
+	op_func op;
+	void (*capture)(void *ctx, const struct dso_capture *capture);
+	void (*warning)(void *ctx, const struct dso_warning *warning);
+
+	/* Called from the receiving thread as it stops: error is 0 at the end
+	 * of a replay or after dso_stop(), else the error it stopped on */
+	void (*done)(void *ctx, int error);
+	void *ctx;
+};
+
+/* A capture stored in the adapter's flash, as listed by dso_store_list().
+ * stored is less than bytes if the capture did not fit. */
+struct dso_stored {
+	uint32_t seq;
+	uint16_t id;
+	uint32_t stored;
+	uint32_t bytes;
+};
+
+struct dso_store_list {
+	struct dso_stored *entries;
+	int max;
+	int total;
+	int complete;
+};
+
+struct dso {
+	struct dso_transport *transport;
+	struct dso_callbacks cb;
+	struct frame_decoder frame;
+	struct op_decoder dec;
+	struct raw raw;
+	struct trace_dump trace;
+	struct dso_store_list store;
+	uint8_t mode;
+	int keep_data;
+
+	int in_capture;
+	int plot_end;
+	uint16_t capture_id;
+	uint32_t capture_bytes;
+	uint8_t flags;
+	int captures;
+	unsigned long long bytes;
+
+	uint8_t *data;
+	size_t data_len;
+	size_t data_size;
+
+	pthread_t thread;
+	int running;
+	volatile int stop;
+};
+
+void dso_init(struct dso *d, struct dso_transport *transport,
+		const struct dso_callbacks *cb);
+void dso_free(struct dso *d);
+
+int dso_set_mode(struct dso *d, uint8_t mode);
+int dso_generate(struct dso *d, uint8_t captures, uint8_t rate);
+int dso_receive(struct dso *d, unsigned timeout);
+int dso_dump_trace(struct dso *d, unsigned timeout);
+int dso_store(struct dso *d, int enable);
+int dso_store_list(struct dso *d, struct dso_stored *entries, int max,
+		unsigned timeout);
+int dso_store_fetch(struct dso *d, uint32_t seq, unsigned timeout);
+
+/* Receives on a thread until dso_stop(), an error or the end of a replay,
+ * when the done callback is called. Requests may be made meanwhile, but not
+ * the calls above that receive their replies. */
+int dso_start(struct dso *d);
+void dso_stop(struct dso *d);
+
+#endif /* DSO_H */
@@ -17,187 +17,1093 @@
  * 3. This notice may not be removed or altered from any source distribution.
  */
 
+#include "archive.h"
+#include "average.h"
 #include "common.h"
+#include "convert.h"
+#include "dso.h"
+#include "mask.h"
+#include "measure.h"
+#include "persist.h"
+#include "preview.h"
+#include "spectrum.h"
+#include "svg.h"
+#include "zout.h"
 #include <errno.h>
-#include <libusb.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-static libusb_device_handle *dso = 0;
-static int libusb_inited = 0;
-static int iface_claimed = 0;
+/* The client side of a session: what dsoctl does with the packets, drawing
+ * operations and captures that libdso475 delivers */
+struct session {
+	struct dso dso;
+	struct svg svg;
+	struct zout *zout;
+	struct preview *preview;
+	struct average *average;
+	FILE *average_file;
+	struct spectrum *spectrum;
+	FILE *spectrum_file;
+	int spectrum_csv;
+	struct persist *persist;
+	const char *persist_path;
+	int persist_every;
+	int persist_written;
+	FILE *raw_file;
+	struct archive_writer *archive;
+	const struct mask *mask;
+	struct mask_trace mask_trace;
+	int mask_failures;
+	struct measure *measure;
+	FILE *measure_file;
+	int measure_csv;
+};
 
-static int receive_data(libusb_device_handle *dev, uint8_t **dest, size_t *len)
+static void session_capture(void *ctx, const struct dso_capture *capture)
 {
-	int r;
+	struct session *s = ctx;
+
+	if (s->archive && archive_append(s->archive, capture->id, capture->mode,
+				capture->flags & DSO_CAPTURE_INCOMPLETE ?
+				ARCHIVE_INCOMPLETE : 0,
+				capture->data, capture->len) < 0) {
+		perror("Failed to archive capture");
+	}
+}
+
+/* How long to wait for data before checking for SIGUSR1, as the adapter
+ * sends nothing between captures */
+#define PERSIST_POLL_MS 200
+
+static volatile sig_atomic_t persist_requested = 0;
+
+static void on_sigusr1(int sig)
+{
+	(void) sig;
+	persist_requested = 1;
+}
+
+static void persist_export(struct session *s)
+{
+	persist_requested = 0;
+	s->persist_written = s->persist->captures;
+
+	if (persist_write_png(s->persist, s->persist_path) == 0) {
+		fprintf(stderr, "Wrote %s after %d captures\n", s->persist_path,
+				s->persist->captures);
+	}
+}
+
+/* Drawing operations go to the SVG writer and, when testing against a
+ * mask or measuring, to the trace reconstruction. The verdict and the
+ * measurements are given at OP_END. */
+static void session_op(void *ctx, const struct op *op)
+{
+	struct session *s = ctx;
+	int capture = s->dso.captures + 1;
+
+	/* When averaging, the SVG is of the averages instead of the captures */
+	if (!s->average) {
+		svg_op(&s->svg, op);
+	} else if (average_op(s->average, op)) {
+		average_replay(s->average, svg_op, &s->svg);
+
+		if (s->average_file) {
+			average_write_csv(s->average_file, s->average);
+			fflush(s->average_file);
+		}
+	}
+
+	if (s->preview) {
+		preview_op(s->preview, op);
+	}
+
+	if (op->code == OP_END) {
+		zout_capture_end(s->zout);
+	}
 
-	*dest = 0;
-	*len = 0;
+	if (s->measure) {
+		measure_op(s->measure, op);
 
-	while (1) {
-		unsigned char buf [8];
-		int rlen;
-		r = libusb_bulk_transfer(dev, 0x82, buf, sizeof(buf), &rlen, 0);
-		if (r < 0) {
-			fprintf(stderr, "Failed to receive data %d\n", r);
-			goto end;
+		if (op->code == OP_END) {
+			if (s->measure_csv) {
+				measure_write_csv(s->measure_file, s->measure, capture);
+			} else {
+				measure_write_json(s->measure_file, s->measure, capture);
+			}
+
+			fflush(s->measure_file);
 		}
+	}
 
-		if (rlen == 0) {
-			continue;
+	if (s->persist) {
+		persist_op(s->persist, op);
+
+		if (op->code == OP_END && s->persist_every &&
+				s->persist->captures % s->persist_every == 0) {
+			persist_export(s);
 		}
+	}
 
-		*len += rlen;
-		*dest = realloc(*dest, *len);
-		strncpy((char *) *dest + *len - rlen, (char *) buf, rlen);
+	if (s->spectrum) {
+		spectrum_op(s->spectrum, op);
 
-		uint8_t packet_length = ((uint8_t *) *dest)[0];
+		if (op->code == OP_END) {
+			spectrum_compute(s->spectrum);
 
-		if (packet_length == 0) {
-			continue;
-		} else if (*len > packet_length) {
-			r = -E2BIG;
-			break;
-		} else if (*len >= packet_length) {
-			r = 0;
-			break;
+			if (s->spectrum_csv) {
+				spectrum_write_csv(s->spectrum_file, s->spectrum, capture);
+			} else {
+				spectrum_write_svg(s->spectrum_file, s->spectrum, capture);
+			}
+
+			fflush(s->spectrum_file);
 		}
 	}
 
-end:
-	return r;
+	if (!s->mask) {
+		return;
+	}
+
+	mask_trace_op(&s->mask_trace, op);
+
+	if (op->code == OP_END) {
+		int n = mask_test(s->mask, &s->mask_trace);
+
+		if (!s->mask_trace.points) {
+			fprintf(stderr, "Capture %d: FAIL, no trace for pen %d\n",
+					capture, s->mask->pen);
+		} else if (n) {
+			fprintf(stderr, "Capture %d: FAIL, %d columns outside the mask\n",
+					capture, n);
+		} else {
+			fprintf(stderr, "Capture %d: PASS\n", capture);
+		}
+
+		s->mask_failures += n || !s->mask_trace.points;
+	}
 }
 
-static void close_dev()
+static void session_packet(void *ctx, const union usb_packet_in *packet,
+		int gap)
 {
-	if (iface_claimed) {
-		libusb_release_interface(dso, 0);
-		iface_claimed = 0;
+	struct session *s = ctx;
+
+	if (gap) {
+		svg_gap(&s->svg);
 	}
 
-	if (dso) {
-		libusb_close(dso);
+	if (packet->any.type == USB_PACKET_RAW && s->raw_file) {
+		fwrite(packet->data + USB_PACKET_HEADER, 1,
+				packet->any.length - USB_PACKET_HEADER, s->raw_file);
 	}
+}
+
+static void session_warning(void *ctx, const struct dso_warning *warning)
+{
+	char buf [80];
+
+	(void) ctx;
 
-	if (libusb_inited) {
-		libusb_exit(NULL);
-		libusb_inited = 0;
+	dso_format_warning(buf, sizeof(buf), warning);
+	fprintf(stderr, "%s\n", buf);
+}
+
+/* Prints an error returned by libdso475, after what failed if given */
+static void report(const char *what, int error)
+{
+	if (error == -DSO_ERROR_IO && what) {
+		perror(what);
+	} else if (what) {
+		fprintf(stderr, "%s: %s\n", what, dso_strerror(error));
+	} else {
+		fprintf(stderr, "%s\n", dso_strerror(error));
 	}
 }
 
-static int open_dev()
+static void session_init(struct session *s, struct dso_transport *transport,
+		struct zout *zout, FILE *out)
 {
-	int r;
-	ssize_t dev_cnt;
-	libusb_device **devs;
+	const struct dso_callbacks cb = {
+		.packet = session_packet,
+		.op = session_op,
+		.capture = session_capture,
+		.warning = session_warning,
+		.ctx = s,
+	};
 
-	if (libusb_inited) {
-		fprintf(stderr, "libusb already initialised\n");
-		return 1;
+	memset(s, 0, sizeof(*s));
+	s->zout = zout;
+	svg_init(&s->svg, out);
+	dso_init(&s->dso, transport, &cb);
+}
+
+/* Returns 0 once data has been received, 1 at the end of a replay or a
+ * negative error, which has been reported unless it is a timeout */
+static int receive(struct session *s, unsigned timeout)
+{
+	int r = dso_receive(&s->dso, timeout);
+
+	if (r < 0 && r != -DSO_ERROR_TIMEOUT) {
+		report("Failed to receive data", r);
+	}
+
+	fflush(stdout);
+
+	if (s->preview) {
+		preview_update(s->preview);
+	}
+
+	if (s->persist && persist_requested) {
+		persist_export(s);
 	}
 
-	r = libusb_init(NULL);
+	return r > 0 ? 0 : r == 0 ? 1 : r;
+}
+
+/* Opens the first adapter found, reporting any error */
+static int open_usb(struct dso_usb *usb)
+{
+	int r = dso_usb_open(usb);
 
 	if (r < 0) {
-		fprintf(stderr, "Failed to initialize libusb\n");
-		return r;
+		report(0, r);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Opens the adapter, or replays a recording of it or a usbmon capture if
+ * path is given */
+static int open_transport(struct dso_usb *usb, struct dso_file *file,
+		struct dso_pcap *pcap, const char *path, int realtime,
+		struct dso_transport **transport)
+{
+	int r;
+
+	if (path && dso_pcap_is_capture(path)) {
+		*transport = &pcap->transport;
+		r = dso_pcap_open(pcap, path, realtime);
+	} else if (path) {
+		*transport = &file->transport;
+		r = dso_file_open(file, path);
+	} else {
+		*transport = &usb->transport;
+		return open_usb(usb);
 	}
-	libusb_inited = 1;
 
-	r = dev_cnt = libusb_get_device_list(NULL, &devs);
 	if (r < 0) {
-		fprintf(stderr, "Failed to get device list\n");
+		report(path, r);
+		return 1;
+	}
+
+	return 0;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Has the device plot synthetic captures and measures how fast they
+ * arrive, converted to SVG that is thrown away. */
+static int bench(int raw, int count, int rate)
+{
+	struct session s;
+	struct dso_usb usb;
+	struct dso *d = &s.dso;
+	FILE *null = fopen("/dev/null", "w");
+	int r;
+
+	if (!null) {
+		perror("/dev/null");
+		return 1;
+	}
+
+	if ((r = open_usb(&usb))) {
+		fclose(null);
 		return r;
 	}
 
-	for (int i = 0; i < dev_cnt; i++) {
-		struct libusb_device_descriptor desc;
-		libusb_device *dev = devs[i];
+	struct zout zout;
+
+	zout_open(&zout, null, ZOUT_NONE);
+	session_init(&s, &usb.transport, &zout, null);
+
+	if ((r = dso_set_mode(d, raw ? MODE_RAW : MODE_CONVERT))) {
+		report("Failed to set mode", r);
+		goto exit;
+	}
 
-		r = libusb_get_device_descriptor(dev, &desc);
-		if (r < 0) {
-			fprintf(stderr, "Cannot get device descriptor\n");
+	double start = now();
+	double first = 0;
+	double last = 0;
+	double longest = 0;
+
+	if ((r = dso_generate(d, count, rate))) {
+		report("Failed to start the generator", r);
+		goto exit;
+	}
+
+	while (d->captures < count) {
+		int captures = d->captures;
+
+		if ((r = receive(&s, 2000))) {
+			fprintf(stderr, "Stalled after %d captures\n", d->captures);
+			dso_generate(d, 0, 0);
 			break;
 		}
 
-		if (desc.idVendor == 0x9876 && desc.idProduct == 0x4567) {
-			r = libusb_open(dev, &dso);
-			if (r < 0) {
-				fprintf(stderr, "Failed to open device\n");
+		if (d->captures != captures) {
+			double t = now();
+
+			if (!first) {
+				first = t;
+			} else if (t - last > longest) {
+				longest = t - last;
 			}
+
+			last = t;
+		}
+	}
+
+	double elapsed = last - start;
+
+	if (d->captures && elapsed > 0) {
+		printf("%d captures, %llu bytes in %.3f s\n", d->captures, d->bytes,
+				elapsed);
+		printf("%.3f MB/s, %.0f packets/s\n", d->bytes / elapsed / 1e6,
+				d->frame.packets / elapsed);
+		printf("first capture after %.2f ms", (first - start) * 1e3);
+
+		if (d->captures > 1) {
+			printf(", then %.2f ms per capture (longest %.2f ms)",
+					(last - first) * 1e3 / (d->captures - 1), longest * 1e3);
+		}
+
+		printf("\n");
+	}
+
+	if (d->frame.lost || d->frame.corrupt) {
+		printf("%lu packets lost, %lu corrupt\n", d->frame.lost,
+				d->frame.corrupt);
+	}
+
+exit:
+	dso_free(d);
+	usb.transport.close(&usb.transport);
+	fclose(null);
+
+	return r ? 1 : 0;
+}
+
+/* Ends the synthetic captures of an interrupted bench, which would
+ * otherwise keep the adapter from reading the UART */
+static int bench_stop()
+{
+	struct dso_usb usb;
+	struct dso d;
+	int r;
+
+	if ((r = open_usb(&usb))) {
+		return r;
+	}
+
+	dso_init(&d, &usb.transport, 0);
+
+	if ((r = dso_generate(&d, 0, 0))) {
+		report("Failed to stop the generator", r);
+	}
+
+	dso_free(&d);
+	usb.transport.close(&usb.transport);
+
+	return r ? 1 : 0;
+}
+
+static int bench_main(int argc, char *argv[])
+{
+	int raw = 0;
+	int count = 10;
+	int rate = 0;
+	int opt;
+
+	optind = 1;
+
+	while ((opt = getopt(argc, argv, "rn:b:s")) != -1) {
+		switch (opt) {
+		case 's':
+			return bench_stop();
+		case 'r':
+			raw = 1;
 			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'b':
+			rate = atoi(optarg);
+			break;
+		default:
+			count = 0;
 		}
 	}
 
-	libusb_free_device_list(devs, 1);
+	if (count < 1 || count > 255 || rate < 0 || rate > 255) {
+		fprintf(stderr, "Usage: dsoctl bench [-r] [-n captures] "
+				"[-b bytes-per-ms]\n");
+		fprintf(stderr, "       dsoctl bench -s\n");
+		fprintf(stderr, "Measures the adapter's throughput with up to 255 "
+				"synthetic captures, generated at\nthe given rate or as "
+				"fast as possible. -r converts them on the host.\n-s stops "
+				"the captures of an interrupted bench.\n");
+		return 1;
+	}
 
-	if (r < 0) {
+	return bench(raw, count, rate);
+}
+
+/* Has the adapter store captures in its flash, or send them again */
+static int store_main(int argc, char *argv[])
+{
+	struct dso_usb usb;
+	struct dso d;
+	int r;
+
+	if (argc != 2 || (strcmp(argv[1], "on") != 0 &&
+				strcmp(argv[1], "off") != 0)) {
+		fprintf(stderr, "Usage: dsoctl store on|off\n");
+		fprintf(stderr, "With on, the adapter stores captures in its flash "
+				"instead of sending them,\nuntil they are fetched with "
+				"dsoctl fetch. The oldest are overwritten when\nthe store "
+				"is full.\n");
+		return 1;
+	}
+
+	if ((r = open_usb(&usb))) {
+		return r;
+	}
+
+	dso_init(&d, &usb.transport, 0);
+
+	if ((r = dso_store(&d, strcmp(argv[1], "on") == 0))) {
+		report("Failed to set storing", r);
+	}
+
+	dso_free(&d);
+	usb.transport.close(&usb.transport);
+
+	return r ? 1 : 0;
+}
+
+/* Downloads the captures stored on the adapter, oldest first, as SVG on
+ * stdout and optionally into an archive */
+static int fetch_main(int argc, char *argv[])
+{
+	const char *archive_path = 0;
+	const char *replay_path = 0;
+	int list = 0;
+	int delta = 0;
+	int opt;
+	int r;
+
+	optind = 1;
+
+	while ((opt = getopt(argc, argv, "la:df:")) != -1) {
+		switch (opt) {
+		case 'l':
+			list = 1;
+			break;
+		case 'a':
+			archive_path = optarg;
+			break;
+		case 'd':
+			delta = 1;
+			break;
+		case 'f':
+			replay_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: dsoctl fetch [-l] [-a archive [-d]] "
+					"[-f replay-file]\n");
+			fprintf(stderr, "Writes the captures stored on the adapter as "
+					"SVG, or lists them with -l.\n-a and -d also store "
+					"them in a new archive as for live captures.\n");
+			return 1;
+		}
+	}
+
+	struct dso_usb usb;
+	struct dso_file file;
+	struct dso_pcap pcap;
+	struct dso_transport *transport;
+
+	if ((r = open_transport(&usb, &file, &pcap, replay_path, 0,
+			&transport))) {
 		return r;
 	}
 
-	if (!dso) {
-		fprintf(stderr, "No device found\n");
+	struct session s;
+	struct dso *d = &s.dso;
+	struct zout zout;
+	struct archive_writer archive;
+	struct dso_stored entries [256];
+	int total;
+
+	zout_open(&zout, stdout, ZOUT_NONE);
+	session_init(&s, transport, &zout, stdout);
+
+	if ((total = dso_store_list(d, entries, 256, 2000)) < 0) {
+		report("Failed to list the stored captures", total);
 		r = 1;
 		goto exit;
 	}
 
-	r = libusb_claim_interface(dso, 0);
-	if (r < 0) {
-		fprintf(stderr, "Failed to claim interface\n");
+	if (list) {
+		for (int i = 0; i < total; i++) {
+			printf("%u\tid %u\t%u bytes%s\n", (unsigned) entries[i].seq,
+					entries[i].id, (unsigned) entries[i].stored,
+					entries[i].stored < entries[i].bytes ?
+					"\ttruncated" : "");
+		}
+
 		goto exit;
 	}
-	iface_claimed = 1;
 
-	return 0;
+	if (archive_path) {
+		if (archive_create(&archive, archive_path, transport->serial,
+				delta) < 0) {
+			r = 1;
+			goto exit;
+		}
+
+		s.archive = &archive;
+		d->keep_data = 1;
+	}
+
+	for (int i = 0; i < total && !r; i++) {
+		if ((r = dso_store_fetch(d, entries[i].seq, 2000)) > 0) {
+			fprintf(stderr, "Capture %u is no longer stored\n",
+					(unsigned) entries[i].seq);
+			r = 0;
+		} else if (r < 0) {
+			fprintf(stderr, "Failed to fetch capture %u: %s\n",
+					(unsigned) entries[i].seq, dso_strerror(r));
+		}
+
+		fflush(stdout);
+	}
+
+	if (s.archive && archive_close(s.archive) < 0) {
+		perror(archive_path);
+		r = 1;
+	}
+
 exit:
-	close_dev();
-	return r;
+	dso_free(d);
+	transport->close(transport);
+
+	return r ? 1 : 0;
 }
 
-static int read_dso()
+struct options {
+	const char *replay_path;
+	int realtime;
+	int raw;
+	FILE *raw_file;
+	FILE *trace_file;
+	const char *archive_path;
+	int archive_delta;
+	const struct mask *mask;
+	const char *measure_path;
+	struct preview *preview;
+	struct average *average;
+	FILE *average_file;
+	const char *spectrum_path;
+	struct persist *persist;
+	const char *persist_path;
+	int persist_every;
+	int count;
+};
+
+static int read_dso(const struct options *o, struct zout *out)
 {
+	struct dso_usb usb;
+	struct dso_file file;
+	struct dso_pcap pcap;
+	struct dso_transport *transport;
 	int r = 0;
 
-	if ((r = open_dev())) {
+	if ((r = open_transport(&usb, &file, &pcap, o->replay_path, o->realtime,
+			&transport))) {
 		return r;
 	}
 
-	while (1) {
-		uint8_t *rbuf;
-		size_t len;
-		r = receive_data(dso, &rbuf, &len);
+	struct session s;
+	struct dso *d = &s.dso;
+	struct archive_writer archive;
+	struct measure measure;
+	struct spectrum spectrum;
+	FILE *svg_out = out->in;
+	int measure_stdout = o->measure_path &&
+		strcmp(o->measure_path, "-") == 0;
 
-		if (r < 0) {
-			if (rbuf) {
-				free(rbuf);
-			}
-			break;
+	/* Measurements written to stdout replace the SVG */
+	if (measure_stdout && out->out == stdout &&
+			!(svg_out = fopen("/dev/null", "w"))) {
+		perror("/dev/null");
+		transport->close(transport);
+		return 1;
+	}
+
+	session_init(&s, transport, out, svg_out);
+
+	if ((r = dso_set_mode(d, o->raw ? MODE_RAW : MODE_CONVERT))) {
+		report("Failed to set mode", r);
+		goto exit;
+	}
+
+	if (o->measure_path) {
+		size_t len = strlen(o->measure_path);
+
+		s.measure = &measure;
+		s.measure_csv = len > 4 &&
+			strcmp(o->measure_path + len - 4, ".csv") == 0;
+		s.measure_file = measure_stdout ? stdout :
+			fopen(o->measure_path, "w");
+
+		if (!s.measure_file) {
+			perror(o->measure_path);
+			r = 1;
+			goto exit;
 		}
 
-		for (size_t i = 2; i < len; i++) {
-			printf("%c", rbuf[i]);
+		measure_init(&measure);
+
+		if (s.measure_csv) {
+			measure_write_csv_header(s.measure_file);
 		}
+	}
 
-		fflush(stdout);
+	if (o->spectrum_path) {
+		size_t len = strlen(o->spectrum_path);
+
+		s.spectrum = &spectrum;
+		s.spectrum_csv = len > 4 &&
+			strcmp(o->spectrum_path + len - 4, ".csv") == 0;
+
+		if (!(s.spectrum_file = fopen(o->spectrum_path, "w"))) {
+			perror(o->spectrum_path);
+			r = 1;
+			goto exit;
+		}
+
+		spectrum_init(&spectrum);
+
+		if (s.spectrum_csv) {
+			spectrum_write_csv_header(s.spectrum_file);
+		}
+	}
+
+	if (o->archive_path) {
+		if (archive_create(&archive, o->archive_path, transport->serial,
+				o->archive_delta) < 0) {
+			r = 1;
+			goto exit;
+		}
+
+		s.archive = &archive;
+		d->keep_data = 1;
+	}
+
+	s.raw_file = o->raw_file;
+	s.preview = o->preview;
+	s.average = o->average;
+	s.average_file = o->average_file;
+	s.persist = o->persist;
+	s.persist_path = o->persist_path;
+	s.persist_every = o->persist_every;
+
+	if ((s.mask = o->mask)) {
+		mask_trace_init(&s.mask_trace, o->mask->pen);
+	}
 
-		if (len >= 7 && strncmp((char *) rbuf + len - 7, "</svg>\n", 7) == 0) {
-			free(rbuf);
+	/* With -P, exports asked for while the adapter is idle are made once
+	 * the wait times out */
+	while (o->count == 0 || d->captures < o->count) {
+		r = receive(&s, s.persist ? PERSIST_POLL_MS : 0);
+
+		if (r && r != -DSO_ERROR_TIMEOUT) {
 			break;
 		}
 
-		free(rbuf);
+		r = 0;
+	}
+
+	/* A replay without a capture count is read to the end */
+	if (r > 0) {
+		if (o->count) {
+			fprintf(stderr, "Replay ended after %d captures\n", d->captures);
+		} else {
+			r = 0;
+		}
+	}
+
+	if (!r && o->trace_file) {
+		if ((r = dso_dump_trace(d, 0))) {
+			report("Trace dump incomplete", r);
+		} else {
+			trace_write_json(o->trace_file, d->trace.events,
+					d->trace.received);
+		}
+	}
+
+	if (d->frame.lost || d->frame.corrupt) {
+		fprintf(stderr, "%lu packets received, %lu lost, %lu corrupt\n",
+				d->frame.packets, d->frame.lost, d->frame.corrupt);
+	}
+
+	if (s.persist && s.persist->captures != s.persist_written) {
+		persist_export(&s);
+	}
+
+	if (s.archive && archive_close(s.archive) < 0) {
+		perror(o->archive_path);
+		r = 1;
+	}
+
+exit:
+	dso_free(d);
+	transport->close(transport);
+
+	if (s.measure_file && s.measure_file != stdout) {
+		fclose(s.measure_file);
+	}
+
+	if (s.spectrum_file) {
+		fclose(s.spectrum_file);
 	}
 
-	close_dev();
+	if (svg_out != out->in) {
+		fclose(svg_out);
+	}
+
+	if (r < 0) {
+		r = 1;
+	} else if (!r && s.mask_failures) {
+		r = 2;
+	}
 
 	return r;
 }
 
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-r] [-w raw-file] [-n captures] [-t trace-file] "
+			"[-a archive [-d]]\n"
+			"       [-m mask-file] [-M measure-file] [-f replay-file [-T]]\n"
+			"       [-o out-file] [-z gzip|zstd] [-p sixel|kitty] "
+			"[-A captures [-R] [-D data-file]]\n"
+			"       [-F spectrum-file] [-P png-file [-E captures]]\n", argv0);
+	fprintf(stderr, "       %s convert [-j jobs] [-o out-dir] "
+			"[-t svg,png,csv] path...\n", argv0);
+	fprintf(stderr, "       %s archive list|extract|render|mask|test|measure "
+			"archive ...\n", argv0);
+	fprintf(stderr, "       %s bench [-r] [-n captures] [-b bytes-per-ms]\n",
+			argv0);
+	fprintf(stderr, "       %s bench -s\n", argv0);
+	fprintf(stderr, "       %s store on|off\n", argv0);
+	fprintf(stderr, "       %s fetch [-l] [-a archive [-d]] [-f replay-file]\n",
+			argv0);
+	fprintf(stderr, "  -r  receive raw HPGL and convert it on the host\n");
+	fprintf(stderr, "  -w  also write the raw HPGL to raw-file (implies -r)\n");
+	fprintf(stderr, "  -n  number of captures to receive, 0 for no limit "
+			"(default 1)\n");
+	fprintf(stderr, "  -t  then write the device's event trace to trace-file "
+			"as Chrome trace JSON\n");
+	fprintf(stderr, "  -a  also store the captures in a new archive\n");
+	fprintf(stderr, "  -d  store each capture in the archive as its changes "
+			"from the one before\n");
+	fprintf(stderr, "  -m  test each capture's trace against a mask, exiting "
+			"with status 2 if any fail\n");
+	fprintf(stderr, "  -M  write measurements of each capture as JSON lines, "
+			"or CSV if measure-file\n"
+			"      ends in .csv; - writes JSON to stdout instead of the "
+			"SVG\n");
+	fprintf(stderr, "  -o  write the SVG to out-file instead of stdout, "
+			"compressed if it ends in\n"
+			"      .svgz or .zst\n");
+	fprintf(stderr, "  -z  compress the SVG on a writer thread, a gzip member "
+			"or zstd frame per capture\n");
+	fprintf(stderr, "  -p  preview each capture in the terminal as it "
+			"arrives\n");
+	fprintf(stderr, "  -A  write the average of every so many captures' "
+			"traces as SVG instead,\n"
+			"      receiving at least that many\n");
+	fprintf(stderr, "  -R  average over a rolling window, after every "
+			"capture\n");
+	fprintf(stderr, "  -D  also write the averaged traces to data-file as "
+			"CSV\n");
+	fprintf(stderr, "  -F  write the spectrum of each capture as SVG, or CSV "
+			"if spectrum-file ends\n"
+			"      in .csv\n");
+	fprintf(stderr, "  -P  accumulate a persistence image of all captures and "
+			"write it to png-file\n"
+			"      at the end, on SIGUSR1 and, with -E, every so many "
+			"captures\n");
+	fprintf(stderr, "  -f  replay a recording of the adapter's IN endpoint, "
+			"or its transfers from a\n"
+			"      usbmon pcap or pcapng capture, instead of using the "
+			"adapter\n");
+	fprintf(stderr, "  -T  replay a usbmon capture with its original timing "
+			"rather than at full speed\n");
+}
+
 int main(int argc, char *argv[])
 {
-	(void) argc;
-	(void) argv;
+	struct options o = {.count = 1};
+	struct mask *mask = 0;
+	struct preview *preview = 0;
+	const char *out_path = 0;
+	const char *format_name = 0;
+	FILE *tty = 0;
+	int window = 0;
+	int rolling = 0;
+	int opt;
+
+	if (argc > 1 && strcmp(argv[1], "convert") == 0) {
+		return convert_main(argc - 1, argv + 1);
+	}
 
-	return read_dso();
+	if (argc > 1 && strcmp(argv[1], "archive") == 0) {
+		return archive_main(argc - 1, argv + 1);
+	}
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		return bench_main(argc - 1, argv + 1);
+	}
+
+	if (argc > 1 && strcmp(argv[1], "store") == 0) {
+		return store_main(argc - 1, argv + 1);
+	}
+
+	if (argc > 1 && strcmp(argv[1], "fetch") == 0) {
+		return fetch_main(argc - 1, argv + 1);
+	}
+
+	while ((opt = getopt(argc, argv, "rw:n:t:a:dm:M:f:To:z:p:A:RD:F:P:E:")) != -1) {
+		switch (opt) {
+		case 'r':
+			o.raw = 1;
+			break;
+		case 'w':
+			o.raw = 1;
+			o.raw_file = fopen(optarg, "ab");
+
+			if (!o.raw_file) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			o.count = atoi(optarg);
+			break;
+		case 'a':
+			o.archive_path = optarg;
+			break;
+		case 'd':
+			o.archive_delta = 1;
+			break;
+		case 'm':
+			if (!mask && !(mask = malloc(sizeof(*mask)))) {
+				fprintf(stderr, "Out of memory\n");
+				return 1;
+			}
+
+			if (mask_load(mask, optarg) < 0) {
+				return 1;
+			}
+			break;
+		case 'M':
+			o.measure_path = optarg;
+			break;
+		case 'f':
+			o.replay_path = optarg;
+			break;
+		case 'T':
+			o.realtime = 1;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'z':
+			switch (zout_format(optarg)) {
+			case ZOUT_NONE:
+				fprintf(stderr, "Unknown compression %s\n", optarg);
+				/* fall through */
+			case -1:
+				return 1;
+			}
+
+			format_name = optarg;
+			break;
+		case 'p':
+			if (preview_protocol(optarg) < 0) {
+				fprintf(stderr, "Unknown preview protocol %s\n", optarg);
+				return 1;
+			}
+
+			if (!preview && !(preview = malloc(sizeof(*preview)))) {
+				fprintf(stderr, "Out of memory\n");
+				return 1;
+			}
+
+			if (!tty && !(tty = fopen("/dev/tty", "w"))) {
+				perror("/dev/tty");
+				return 1;
+			}
+
+			preview_init(preview, tty, preview_protocol(optarg));
+			break;
+		case 'A':
+			window = atoi(optarg);
+
+			if (window < 1) {
+				fprintf(stderr, "Averaging needs at least 1 capture\n");
+				return 1;
+			}
+			break;
+		case 'R':
+			rolling = 1;
+			break;
+		case 'F':
+			o.spectrum_path = optarg;
+			break;
+		case 'P':
+			o.persist_path = optarg;
+			break;
+		case 'E':
+			o.persist_every = atoi(optarg);
+
+			if (o.persist_every < 1) {
+				fprintf(stderr, "-E needs at least 1 capture\n");
+				return 1;
+			}
+			break;
+		case 'D':
+			if (!(o.average_file = fopen(optarg, "w"))) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			o.trace_file = fopen(optarg, "w");
+
+			if (!o.trace_file) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	FILE *out = stdout;
+	struct zout zout;
+	int format = zout_format(format_name ? format_name :
+			out_path ? out_path : "");
+
+	if (out_path && !(out = fopen(out_path, "wb"))) {
+		perror(out_path);
+		return 1;
+	}
+
+	if (format < 0 || zout_open(&zout, out, format) < 0) {
+		return 1;
+	}
+
+	if (window) {
+		/* aligned_alloc, as the sums are in 32 byte vectors */
+		size_t size = (sizeof(*o.average) + 31) / 32 * 32;
+
+		if (!(o.average = aligned_alloc(32, size)) ||
+				average_init(o.average, window, rolling) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+
+		if (o.average_file) {
+			average_write_csv_header(o.average_file);
+		}
+
+		/* Enough captures for an average, unless there is no limit */
+		if (o.count && o.count < window) {
+			o.count = window;
+		}
+	} else if (rolling || o.average_file) {
+		fprintf(stderr, "-R and -D need -A\n");
+		return 1;
+	}
+
+	if (o.persist_path) {
+		if (!(o.persist = malloc(sizeof(*o.persist)))) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+
+		persist_init(o.persist);
+		signal(SIGUSR1, on_sigusr1);
+	}
+
+	o.mask = mask;
+	o.preview = preview;
+
+	int r = read_dso(&o, &zout);
+
+	if (zout_close(&zout) < 0) {
+		fprintf(stderr, "Failed to write %s\n", out_path ? out_path :
+				"the output");
+		r = r ? r : 1;
+	}
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	if (o.raw_file) {
+		fclose(o.raw_file);
+	}
+
+	if (o.trace_file) {
+		fclose(o.trace_file);
+	}
+
+	if (tty) {
+		fclose(tty);
+	}
+
+	if (o.average_file) {
+		fclose(o.average_file);
+	}
+
+	if (o.average) {
+		average_free(o.average);
+		free(o.average);
+	}
+
+	free(o.persist);
+	free(preview);
+	free(mask);
+
+	return r;
 }
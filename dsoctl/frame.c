@@ -0,0 +1,98 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "frame.h"
+#include <string.h>
+
+void frame_decoder_init(struct frame_decoder *fr, frame_func func, void *ctx)
+{
+	memset(fr, 0, sizeof(*fr));
+	fr->func = func;
+	fr->ctx = ctx;
+}
+
+static void discard(struct frame_decoder *fr)
+{
+	fr->corrupt++;
+	fr->gap = 1;
+	fr->len = 0;
+}
+
+static int complete(struct frame_decoder *fr)
+{
+	struct usb_packet_any *any = &fr->packet.any;
+
+	fr->len = 0;
+
+	if (usb_packet_crc(&fr->packet) != any->crc) {
+		if (fr->error) {
+			fr->error(fr->ctx, FRAME_CORRUPT, 1, any->seq);
+		}
+
+		discard(fr);
+		return -1;
+	}
+
+	if (fr->have_seq && any->seq != (uint8_t) (fr->seq + 1)) {
+		uint8_t lost = any->seq - fr->seq - 1;
+
+		if (fr->error) {
+			fr->error(fr->ctx, FRAME_LOST, lost, any->seq);
+		}
+
+		fr->lost += lost;
+		fr->gap = 1;
+	}
+
+	fr->have_seq = 1;
+	fr->seq = any->seq;
+	fr->packets++;
+
+	fr->func(fr->ctx, &fr->packet, fr->gap);
+	fr->gap = 0;
+
+	return 0;
+}
+
+void frame_decoder_feed(struct frame_decoder *fr, const uint8_t *data,
+		size_t len)
+{
+	while (len) {
+		if (fr->len == 0 && (data[0] < USB_PACKET_HEADER ||
+					data[0] > USB_PACKET_MAX)) {
+			discard(fr);
+			return;
+		}
+
+		size_t n = fr->len ? fr->packet.any.length - fr->len : data[0];
+
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(fr->packet.data + fr->len, data, n);
+		fr->len += n;
+		data += n;
+		len -= n;
+
+		if (fr->len == fr->packet.any.length && complete(fr) < 0) {
+			return;
+		}
+	}
+}
@@ -0,0 +1,63 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "common.h"
+#include <stddef.h>
+
+typedef void (*frame_func)(void *ctx, const union usb_packet_in *packet,
+		int gap);
+
+/* Errors passed to the optional error callback as they are found */
+enum {
+	FRAME_CORRUPT, /* packet seq failed its CRC check */
+	FRAME_LOST,    /* count packets were lost before packet seq */
+};
+
+typedef void (*frame_error_func)(void *ctx, int error, unsigned count,
+		uint8_t seq);
+
+/* Reassembles packets from the data read from the IN endpoint, checks their
+ * CRC and sequence number and passes the good ones to func. gap is set when
+ * packets have been lost or discarded since the previous one. A packet
+ * always starts at the beginning of a USB packet, so after an error the rest
+ * of the data read is dropped and the next read is tried as a packet start. */
+struct frame_decoder {
+	union usb_packet_in packet;
+	uint8_t len;
+	uint8_t seq;
+	int have_seq;
+	int gap;
+
+	unsigned long packets;
+	unsigned long lost;
+	unsigned long corrupt;
+
+	frame_func func;
+	frame_error_func error;
+	void *ctx;
+};
+
+void frame_decoder_init(struct frame_decoder *fr, frame_func func, void *ctx);
+void frame_decoder_feed(struct frame_decoder *fr, const uint8_t *data,
+		size_t len);
+
+#endif /* FRAME_H */
@@ -0,0 +1,206 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "mask.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+static void fill(mask_vec *vecs, int16_t value)
+{
+	for (int i = 0; i < MASK_VECS; i++) {
+		for (int j = 0; j < MASK_LANES; j++) {
+			vecs[i][j] = value;
+		}
+	}
+}
+
+/* The mask file has a "pen n" line followed by one "x min max" line per
+ * column. Blank lines and lines starting with # are ignored. */
+int mask_load(struct mask *mask, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line [128];
+	int lineno = 0;
+	int r = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	mask->pen = 0;
+	fill(mask->min, INT16_MIN);
+	fill(mask->max, INT16_MAX);
+
+	while (fgets(line, sizeof(line), f)) {
+		int x, min, max;
+
+		lineno++;
+
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0) {
+			continue;
+		}
+
+		if (sscanf(line, "pen %d", &mask->pen) == 1) {
+			continue;
+		}
+
+		if (sscanf(line, "%d %d %d", &x, &min, &max) != 3 ||
+				x < 0 || x >= MASK_WIDTH || min > max ||
+				min < INT16_MIN || max > INT16_MAX) {
+			fprintf(stderr, "%s:%d: invalid mask line\n", path, lineno);
+			r = -1;
+			break;
+		}
+
+		mask->min[x / MASK_LANES][x % MASK_LANES] = min;
+		mask->max[x / MASK_LANES][x % MASK_LANES] = max;
+	}
+
+	if (r == 0 && mask->pen == 0) {
+		fprintf(stderr, "%s: no pen given\n", path);
+		r = -1;
+	}
+
+	fclose(f);
+
+	return r;
+}
+
+void mask_trace_init(struct mask_trace *t, int pen)
+{
+	t->pen = pen;
+	t->cur_pen = 0;
+	t->in_trace = 0;
+	t->points = 0;
+	t->segment = 0;
+	fill(t->lo, INT16_MAX);
+	fill(t->hi, INT16_MIN);
+}
+
+static void column(struct mask_trace *t, int x, int y)
+{
+	if (x < 0 || x >= MASK_WIDTH) {
+		return;
+	}
+
+	int16_t *lo = &t->lo[x / MASK_LANES][x % MASK_LANES];
+	int16_t *hi = &t->hi[x / MASK_LANES][x % MASK_LANES];
+
+	*lo = MIN(*lo, y);
+	*hi = MAX(*hi, y);
+}
+
+static void point(struct mask_trace *t, int x, int y)
+{
+	t->points++;
+
+	if (t->segment++ && abs(x - t->last_x) > 1) {
+		int x0 = t->last_x;
+		int y0 = t->last_y;
+		int step = x > x0 ? 1 : -1;
+
+		for (int i = x0 + step; i != x; i += step) {
+			column(t, i, y0 + (y - y0) * (i - x0) / (x - x0));
+		}
+	}
+
+	column(t, x, y);
+	t->last_x = x;
+	t->last_y = y;
+}
+
+void mask_trace_op(void *ctx, const struct op *op)
+{
+	struct mask_trace *t = ctx;
+
+	switch (op->code) {
+	case OP_BEGIN:
+		mask_trace_init(t, t->pen);
+		break;
+	case OP_PEN:
+		t->cur_pen = op->arg[0];
+		break;
+	case OP_POLYLINE:
+		t->in_trace = t->cur_pen == t->pen;
+		t->segment = 0;
+		break;
+	case OP_POLYLINE_END:
+		t->in_trace = 0;
+		break;
+	case OP_POINT:
+		if (t->in_trace) {
+			point(t, op->arg[0], op->arg[1]);
+		}
+		break;
+	case OP_RUN:
+		if (t->in_trace) {
+			for (int i = 0; i < op->count; i++) {
+				point(t, op->x[i], op->y[i]);
+			}
+		}
+		break;
+	case OP_LINE:
+		if (t->cur_pen == t->pen) {
+			t->segment = 0;
+			point(t, op->arg[0], op->arg[1]);
+			point(t, op->arg[2], op->arg[3]);
+			t->segment = 0;
+		}
+		break;
+	}
+}
+
+int mask_test(const struct mask *mask, const struct mask_trace *t)
+{
+	mask_vec fails = {0};
+
+	/* Empty columns have lo > hi and pass any band. Compares give -1 per
+	 * failing lane, so subtracting them counts the failures. */
+	for (int i = 0; i < MASK_VECS; i++) {
+		fails -= (t->lo[i] < mask->min[i]) | (t->hi[i] > mask->max[i]);
+	}
+
+	int n = 0;
+
+	for (int j = 0; j < MASK_LANES; j++) {
+		n += fails[j];
+	}
+
+	return n;
+}
+
+void mask_write(FILE *out, const struct mask_trace *t, int tolerance)
+{
+	fprintf(out, "pen %d\n", t->pen);
+
+	for (int x = 0; x < MASK_WIDTH; x++) {
+		int lo = t->lo[x / MASK_LANES][x % MASK_LANES];
+		int hi = t->hi[x / MASK_LANES][x % MASK_LANES];
+
+		if (lo <= hi) {
+			fprintf(out, "%d %d %d\n", x, MAX(lo - tolerance, INT16_MIN),
+					MIN(hi + tolerance, INT16_MAX));
+		}
+	}
+}
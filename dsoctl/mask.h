@@ -0,0 +1,73 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef MASK_H
+#define MASK_H
+
+#include "ops.h"
+#include <stdio.h>
+
+/* Pass/fail testing of a trace against a tolerance mask, a band of allowed
+ * y values in plotter units for each x column of the screen. The bands are
+ * stored as vectors so that a trace is tested with a handful of SIMD
+ * compares, using the GCC vector extensions. */
+#define MASK_WIDTH 512
+
+typedef int16_t mask_vec __attribute__((vector_size(16)));
+
+#define MASK_LANES ((int) (sizeof(mask_vec) / sizeof(int16_t)))
+#define MASK_VECS (MASK_WIDTH / MASK_LANES)
+
+/* Columns without a band allow any y */
+struct mask {
+	int pen;
+	mask_vec min [MASK_VECS];
+	mask_vec max [MASK_VECS];
+};
+
+/* Reconstructs the trace drawn by the polylines and lines of one pen as the
+ * lowest and highest y in each column. Columns between two points of the
+ * same polyline or line further apart are filled by linear interpolation,
+ * but the gap between two polylines is left empty. points counts the
+ * points of the whole capture and segment those of the current polyline
+ * or line. */
+struct mask_trace {
+	int pen;
+	int cur_pen;
+	int in_trace;
+	int points;
+	int segment;
+	int last_x;
+	int last_y;
+	mask_vec lo [MASK_VECS];
+	mask_vec hi [MASK_VECS];
+};
+
+int mask_load(struct mask *mask, const char *path);
+
+void mask_trace_init(struct mask_trace *t, int pen);
+void mask_trace_op(void *ctx, const struct op *op);
+
+/* Returns the number of columns where the trace leaves the mask */
+int mask_test(const struct mask *mask, const struct mask_trace *t);
+
+/* Writes a mask allowing tolerance either side of the trace */
+void mask_write(FILE *out, const struct mask_trace *t, int tolerance);
+
+#endif /* MASK_H */
@@ -0,0 +1,402 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "measure.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int32_t sum_vec __attribute__((vector_size(32)));
+
+void measure_init(struct measure *m)
+{
+	for (int i = 0; i < MEASURE_CHANNELS; i++) {
+		mask_trace_init(&m->trace[i], i + 2);
+		m->volts_per_div[i] = 0;
+	}
+
+	m->secs_per_div = 0;
+	m->pen = 0;
+	m->in_label = 0;
+	m->label_len = 0;
+}
+
+/* Parses a scale such as "1V/DIV", "20mV/DIV" or "100us/DIV" */
+static void parse_label(struct measure *m)
+{
+	const char *label = m->label;
+	const char *div = strstr(label, "/DIV");
+
+	if (!div) {
+		return;
+	}
+
+	const char *p = div;
+
+	while (p > label && p[-1] != ' ') {
+		p--;
+	}
+
+	char *end;
+	double value = strtod(p, &end);
+
+	if (end == p || value <= 0) {
+		return;
+	}
+
+	switch (*end) {
+	case 'n':
+		value *= 1e-9;
+		end++;
+		break;
+	case 'u':
+		value *= 1e-6;
+		end++;
+		break;
+	case 'm':
+		value *= 1e-3;
+		end++;
+		break;
+	case 'k':
+		value *= 1e3;
+		end++;
+		break;
+	}
+
+	if (end + 1 != div) {
+		return;
+	}
+
+	if (*end == 's' || *end == 'S') {
+		m->secs_per_div = value;
+	} else if (*end == 'V') {
+		int channel = m->pen == 3 ? 1 : 0;
+
+		if (strstr(label, "CH1")) {
+			channel = 0;
+		} else if (strstr(label, "CH2")) {
+			channel = 1;
+		}
+
+		m->volts_per_div[channel] = value;
+	}
+}
+
+void measure_op(void *ctx, const struct op *op)
+{
+	struct measure *m = ctx;
+
+	if (op->code == OP_BEGIN) {
+		measure_init(m);
+	}
+
+	for (int i = 0; i < MEASURE_CHANNELS; i++) {
+		mask_trace_op(&m->trace[i], op);
+	}
+
+	switch (op->code) {
+	case OP_PEN:
+		m->pen = op->arg[0];
+		break;
+	case OP_LABEL:
+		m->in_label = 1;
+		m->label_len = 0;
+		break;
+	case OP_LABEL_END:
+		m->label[m->label_len] = 0;
+		m->in_label = 0;
+		parse_label(m);
+		break;
+	default:
+		if (op->code >= OP_TEXT && m->in_label &&
+				m->label_len < MEASURE_LABEL_MAX - 1) {
+			m->label[m->label_len++] = op->code;
+		}
+	}
+}
+
+static mask_vec select_vec(mask_vec cond, mask_vec a, mask_vec b)
+{
+	return (a & cond) | (b & ~cond);
+}
+
+/* Time at which the line from (x0, y0) to (x1, y1) crosses level */
+static double cross(double x0, double y0, double x1, double y1, double level)
+{
+	return x0 + (level - y0) / (y1 - y0) * (x1 - x0);
+}
+
+enum {
+	LEVEL_NONE,
+	LEVEL_LOW,
+	LEVEL_HIGH,
+};
+
+void measure_channel(const struct measure *m, int channel,
+		struct measurements *out)
+{
+	const struct mask_trace *t = &m->trace[channel];
+	double vscale = (m->volts_per_div[channel] ?
+			m->volts_per_div[channel] : 1) / MEASURE_DIV_Y;
+	double tscale = (m->secs_per_div ? m->secs_per_div : 1) / MEASURE_DIV_X;
+
+	/* Levels in one pass over the columns. Empty columns have lo at its
+	 * maximum and hi at its minimum, so they never win the min and max,
+	 * and are masked out of the sums. */
+	mask_vec vmin = t->lo[0];
+	mask_vec vmax = t->hi[0];
+	sum_vec sum = {0};
+	sum_vec sum_sq = {0};
+	sum_vec count = {0};
+
+	for (int i = 0; i < MASK_VECS; i++) {
+		mask_vec lo = t->lo[i];
+		mask_vec hi = t->hi[i];
+		mask_vec present = lo <= hi;
+		sum_vec mid2 = __builtin_convertvector((lo + hi) & present, sum_vec);
+
+		vmin = select_vec(lo < vmin, lo, vmin);
+		vmax = select_vec(hi > vmax, hi, vmax);
+		sum += mid2;
+		sum_sq += mid2 * mid2;
+		count -= __builtin_convertvector(present, sum_vec);
+	}
+
+	int min = INT16_MAX;
+	int max = INT16_MIN;
+	double total = 0;
+	double total_sq = 0;
+	int n = 0;
+
+	for (int j = 0; j < MASK_LANES; j++) {
+		min = vmin[j] < min ? vmin[j] : min;
+		max = vmax[j] > max ? vmax[j] : max;
+		total += sum[j];
+		total_sq += sum_sq[j];
+		n += count[j];
+	}
+
+	*out = (struct measurements) {
+		.points = n,
+		.vpp = NAN, .min = NAN, .max = NAN, .mean = NAN, .rms = NAN,
+		.period = NAN, .frequency = NAN, .rise = NAN, .fall = NAN,
+		.duty = NAN,
+	};
+
+	if (!n) {
+		return;
+	}
+
+	/* The sums are of twice the y of each column */
+	double mean = total / n / 2;
+	double mean_sq = total_sq / n / 4;
+
+	out->vpp = (max - min) * vscale;
+	out->min = (min - MEASURE_CENTRE_Y) * vscale;
+	out->max = (max - MEASURE_CENTRE_Y) * vscale;
+	out->mean = (mean - MEASURE_CENTRE_Y) * vscale;
+	out->rms = sqrt(fmax(mean_sq - 2 * MEASURE_CENTRE_Y * mean +
+				MEASURE_CENTRE_Y * MEASURE_CENTRE_Y, 0)) * vscale;
+
+	if (max == min) {
+		return;
+	}
+
+	/* Edges are found with hysteresis: a rising edge only counts once the
+	 * trace has been below 10% of its range, a falling edge once it has
+	 * been above 90%. Rise and fall times are between these levels. */
+	double low = min + (max - min) * 0.1;
+	double high = min + (max - min) * 0.9;
+	double level = (min + max) / 2.0;
+	double rising [MASK_WIDTH];
+	double falling [MASK_WIDTH];
+	int n_rising = 0;
+	int n_falling = 0;
+	double rise = 0, fall = 0;
+	int n_rise = 0, n_fall = 0;
+	double t_low = NAN, t_high = NAN;
+	int state = LEVEL_NONE;
+	int armed = LEVEL_NONE;
+	double x0 = 0, y0 = 0;
+	int first = 1;
+
+	for (int x = 0; x < MASK_WIDTH; x++) {
+		int lo = t->lo[x / MASK_LANES][x % MASK_LANES];
+		int hi = t->hi[x / MASK_LANES][x % MASK_LANES];
+
+		if (lo > hi) {
+			continue;
+		}
+
+		double y = (lo + hi) / 2.0;
+
+		if (first) {
+			first = 0;
+			state = y <= low ? LEVEL_LOW : y >= high ? LEVEL_HIGH : LEVEL_NONE;
+			armed = state;
+		} else if (y > y0) {
+			if (y0 < low && y >= low) {
+				t_low = cross(x0, y0, x, y, low);
+			}
+
+			if (y0 < level && y >= level && armed == LEVEL_LOW) {
+				rising[n_rising++] = cross(x0, y0, x, y, level);
+				armed = LEVEL_NONE;
+			}
+
+			if (y0 < high && y >= high) {
+				if (state == LEVEL_LOW && !isnan(t_low)) {
+					rise += cross(x0, y0, x, y, high) - t_low;
+					n_rise++;
+				}
+
+				state = armed = LEVEL_HIGH;
+			}
+		} else if (y < y0) {
+			if (y0 > high && y <= high) {
+				t_high = cross(x0, y0, x, y, high);
+			}
+
+			if (y0 > level && y <= level && armed == LEVEL_HIGH) {
+				falling[n_falling++] = cross(x0, y0, x, y, level);
+				armed = LEVEL_NONE;
+			}
+
+			if (y0 > low && y <= low) {
+				if (state == LEVEL_HIGH && !isnan(t_high)) {
+					fall += cross(x0, y0, x, y, low) - t_high;
+					n_fall++;
+				}
+
+				state = armed = LEVEL_LOW;
+			}
+		}
+
+		x0 = x;
+		y0 = y;
+	}
+
+	if (n_rise) {
+		out->rise = rise / n_rise * tscale;
+	}
+
+	if (n_fall) {
+		out->fall = fall / n_fall * tscale;
+	}
+
+	if (n_rising < 2) {
+		return;
+	}
+
+	double span = rising[n_rising - 1] - rising[0];
+	double high_time = 0;
+
+	for (int i = 0, j = 0; i < n_rising - 1; i++) {
+		while (j < n_falling && falling[j] < rising[i]) {
+			j++;
+		}
+
+		if (j < n_falling && falling[j] < rising[i + 1]) {
+			high_time += falling[j] - rising[i];
+		}
+	}
+
+	out->period = span / (n_rising - 1) * tscale;
+	out->frequency = 1 / out->period;
+	out->duty = high_time / span;
+}
+
+static void json_number(FILE *out, const char *name, double value)
+{
+	if (isnan(value)) {
+		fprintf(out, ", \"%s\": null", name);
+	} else {
+		fprintf(out, ", \"%s\": %g", name, value);
+	}
+}
+
+/* Writes one line of JSON per capture */
+void measure_write_json(FILE *out, const struct measure *m, int capture)
+{
+	fprintf(out, "{\"capture\": %d", capture);
+	json_number(out, "secs_per_div", m->secs_per_div ? m->secs_per_div : NAN);
+	fputs(", \"channels\": [", out);
+
+	for (int i = 0; i < MEASURE_CHANNELS; i++) {
+		struct measurements r;
+
+		measure_channel(m, i, &r);
+		fprintf(out, "%s{\"channel\": %d", i ? ", " : "", i + 1);
+		json_number(out, "volts_per_div",
+				m->volts_per_div[i] ? m->volts_per_div[i] : NAN);
+		fprintf(out, ", \"points\": %d", r.points);
+		json_number(out, "vpp", r.vpp);
+		json_number(out, "min", r.min);
+		json_number(out, "max", r.max);
+		json_number(out, "mean", r.mean);
+		json_number(out, "rms", r.rms);
+		json_number(out, "period", r.period);
+		json_number(out, "frequency", r.frequency);
+		json_number(out, "rise", r.rise);
+		json_number(out, "fall", r.fall);
+		json_number(out, "duty", r.duty);
+		fputc('}', out);
+	}
+
+	fputs("]}\n", out);
+}
+
+void measure_write_csv_header(FILE *out)
+{
+	fputs("capture,channel,volts_per_div,secs_per_div,points,vpp,min,max,"
+			"mean,rms,period,frequency,rise,fall,duty\n", out);
+}
+
+static void csv_number(FILE *out, double value)
+{
+	if (isnan(value)) {
+		fputc(',', out);
+	} else {
+		fprintf(out, ",%g", value);
+	}
+}
+
+void measure_write_csv(FILE *out, const struct measure *m, int capture)
+{
+	for (int i = 0; i < MEASURE_CHANNELS; i++) {
+		struct measurements r;
+
+		measure_channel(m, i, &r);
+		fprintf(out, "%d,%d", capture, i + 1);
+		csv_number(out, m->volts_per_div[i] ? m->volts_per_div[i] : NAN);
+		csv_number(out, m->secs_per_div ? m->secs_per_div : NAN);
+		fprintf(out, ",%d", r.points);
+		csv_number(out, r.vpp);
+		csv_number(out, r.min);
+		csv_number(out, r.max);
+		csv_number(out, r.mean);
+		csv_number(out, r.rms);
+		csv_number(out, r.period);
+		csv_number(out, r.frequency);
+		csv_number(out, r.rise);
+		csv_number(out, r.fall);
+		csv_number(out, r.duty);
+		fputc('\n', out);
+	}
+}
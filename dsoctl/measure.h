@@ -0,0 +1,76 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef MEASURE_H
+#define MEASURE_H
+
+#include "mask.h"
+#include <stdio.h>
+
+/* Measurements of the traces of both channels, taken from the drawing
+ * operations of a capture. Channel 1 is drawn with pen 2 and channel 2 with
+ * pen 3. The scales come from the labels the oscilloscope plots, such as
+ * "CH1 1V/DIV" and "100us/DIV"; without them values are in divisions.
+ * Voltages are relative to the centre line of the graticule. */
+#define MEASURE_CHANNELS 2
+#define MEASURE_LABEL_MAX 32
+
+/* The graticule is 10 divisions of 50 plotter units across and 8 divisions
+ * of 30 units high, centred on y = 128. */
+#define MEASURE_DIV_X 50
+#define MEASURE_DIV_Y 30
+#define MEASURE_CENTRE_Y 128
+
+struct measure {
+	struct mask_trace trace [MEASURE_CHANNELS];
+	double volts_per_div [MEASURE_CHANNELS];
+	double secs_per_div;
+
+	int pen;
+	int in_label;
+	char label [MEASURE_LABEL_MAX];
+	int label_len;
+};
+
+/* Fields are NaN when they can not be measured, e.g. the frequency of a
+ * trace with less than a full period on screen. */
+struct measurements {
+	int points;
+	double vpp;
+	double min;
+	double max;
+	double mean;
+	double rms;
+	double period;
+	double frequency;
+	double rise;
+	double fall;
+	double duty;
+};
+
+void measure_init(struct measure *m);
+void measure_op(void *ctx, const struct op *op);
+void measure_channel(const struct measure *m, int channel,
+		struct measurements *out);
+
+void measure_write_json(FILE *out, const struct measure *m, int capture);
+void measure_write_csv_header(FILE *out);
+void measure_write_csv(FILE *out, const struct measure *m, int capture);
+
+#endif /* MEASURE_H */
@@ -0,0 +1,93 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "ops.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Expands a run into the decoder's point arrays. The nibbles are unpacked
+ * and the x coordinates generated in separate passes so that the compiler
+ * can vectorise them; only the y prefix sum is sequential. */
+static void decode_run(struct op_decoder *dec, struct op *op)
+{
+	const uint8_t *dy_packed = dec->buf + OP_RUN_HEADER;
+	int count = MIN(dec->buf[6], OP_RUN_MAX);
+	int dx = (int8_t) dec->buf[5];
+	int16_t dy [OP_RUN_MAX + 1];
+
+	for (int i = 0; i < (count + 1) / 2; i++) {
+		dy[i * 2] = (int8_t) (dy_packed[i] << 4) >> 4;
+		dy[i * 2 + 1] = (int8_t) dy_packed[i] >> 4;
+	}
+
+	for (int i = 0; i <= count; i++) {
+		dec->run_x[i] = op->arg[0] + i * dx;
+	}
+
+	dec->run_y[0] = op->arg[1];
+
+	for (int i = 0; i < count; i++) {
+		dec->run_y[i + 1] = dec->run_y[i] + dy[i];
+	}
+
+	op->count = count + 1;
+	op->x = dec->run_x;
+	op->y = dec->run_y;
+}
+
+void op_decoder_init(struct op_decoder *dec, op_func func, void *ctx)
+{
+	dec->len = 0;
+	dec->func = func;
+	dec->ctx = ctx;
+}
+
+void op_decoder_reset(struct op_decoder *dec)
+{
+	dec->len = 0;
+}
+
+void op_decoder_feed(struct op_decoder *dec, const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		dec->buf[dec->len++] = data[i];
+
+		if (dec->len < op_size(dec->buf, dec->len)) {
+			continue;
+		}
+
+		struct op op = {dec->buf[0], {0}, 0, 0, 0};
+
+		if (op.code == OP_RUN) {
+			op.arg[0] = (int16_t) (dec->buf[1] | dec->buf[2] << 8);
+			op.arg[1] = (int16_t) (dec->buf[3] | dec->buf[4] << 8);
+			decode_run(dec, &op);
+		} else if (dec->len == 2) {
+			op.arg[0] = dec->buf[1];
+		} else {
+			for (int j = 0; j < (dec->len - 1) / 2; j++) {
+				op.arg[j] = (int16_t) (dec->buf[1 + j * 2] |
+					dec->buf[2 + j * 2] << 8);
+			}
+		}
+
+		dec->len = 0;
+		dec->func(dec->ctx, &op);
+	}
+}
@@ -0,0 +1,54 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef OPS_H
+#define OPS_H
+
+#include "common.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* For OP_RUN, x and y point to the count expanded points of the run, which
+ * remain valid until the next operation is decoded. */
+struct op {
+	uint8_t code;
+	int16_t arg [4];
+	int count;
+	const int16_t *x;
+	const int16_t *y;
+};
+
+typedef void (*op_func)(void *ctx, const struct op *op);
+
+/* Splits the drawing operation stream carried by log packets back into
+ * operations, which may span packet boundaries. */
+struct op_decoder {
+	uint8_t buf [OP_RUN_HEADER + OP_RUN_MAX / 2];
+	uint8_t len;
+	int16_t run_x [OP_RUN_MAX + 1];
+	int16_t run_y [OP_RUN_MAX + 1];
+	op_func func;
+	void *ctx;
+};
+
+void op_decoder_init(struct op_decoder *dec, op_func func, void *ctx);
+void op_decoder_reset(struct op_decoder *dec);
+void op_decoder_feed(struct op_decoder *dec, const uint8_t *data, size_t len);
+
+#endif /* OPS_H */
@@ -0,0 +1,274 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "persist.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define CLAMP(x, a, b) (MIN(MAX(x, a), b))
+
+/* Plotter coordinates to pixels, as the SVG maps them with its view box
+ * starting at -10, -10 */
+#define PX(x) CLAMP((x) + 10, 0, PERSIST_WIDTH - 1)
+#define PY(y) (CLAMP(560 - (y) * 2, 0, 560) + 10)
+
+void persist_init(struct persist *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->top = PERSIST_HEIGHT;
+}
+
+static void mark(struct persist *p, int x, int y)
+{
+	p->mark[y][x / PERSIST_LANES][x % PERSIST_LANES] = 1;
+	p->top = MIN(p->top, y);
+	p->bottom = MAX(p->bottom, y);
+}
+
+static void line(struct persist *p, int x0, int y0, int x1, int y1)
+{
+	int dx = abs(x1 - x0);
+	int dy = -abs(y1 - y0);
+	int sx = x0 < x1 ? 1 : -1;
+	int sy = y0 < y1 ? 1 : -1;
+	int err = dx + dy;
+
+	for (;;) {
+		mark(p, x0, y0);
+
+		if (x0 == x1 && y0 == y1) {
+			break;
+		}
+
+		int e2 = 2 * err;
+
+		if (e2 >= dy) {
+			err += dy;
+			x0 += sx;
+		}
+
+		if (e2 <= dx) {
+			err += dx;
+			y0 += sy;
+		}
+	}
+}
+
+static void point(struct persist *p, int x, int y)
+{
+	x = PX(x);
+	y = PY(y);
+
+	if (p->in_line) {
+		line(p, p->last_x, p->last_y, x, y);
+	} else {
+		mark(p, x, y);
+	}
+
+	p->in_line = 1;
+	p->last_x = x;
+	p->last_y = y;
+}
+
+/* Adds the capture's mask to the counts, where a sum that wraps around is
+ * below what it was added to and saturates */
+static void accumulate(struct persist *p)
+{
+	for (int y = p->top; y <= p->bottom; y++) {
+		for (int i = 0; i < PERSIST_STRIDE; i++) {
+			persist_vec sum = p->hits[y][i] + p->mark[y][i];
+
+			p->hits[y][i] = sum | (persist_vec) (sum < p->hits[y][i]);
+		}
+
+		memset(p->mark[y], 0, sizeof(p->mark[y]));
+	}
+
+	p->top = PERSIST_HEIGHT;
+	p->bottom = 0;
+	p->captures++;
+}
+
+/* Labels are left out, as they are the same in every capture */
+void persist_op(void *ctx, const struct op *op)
+{
+	struct persist *p = ctx;
+
+	switch (op->code) {
+	case OP_END:
+		accumulate(p);
+		break;
+	case OP_POINT:
+		point(p, op->arg[0], op->arg[1]);
+		break;
+	case OP_RUN:
+		for (int i = 0; i < op->count; i++) {
+			point(p, op->x[i], op->y[i]);
+		}
+		break;
+	case OP_LINE:
+		p->in_line = 0;
+		point(p, op->arg[0], op->arg[1]);
+		point(p, op->arg[2], op->arg[3]);
+		p->in_line = 0;
+		break;
+	case OP_MARKER:
+		mark(p, PX(op->arg[0]), PY(op->arg[1]));
+		break;
+	case OP_BEGIN:
+	case OP_POLYLINE:
+	case OP_POLYLINE_END:
+	case OP_RESYNC:
+		p->in_line = 0;
+		break;
+	}
+}
+
+/* Pixels hit by every capture are white, and rarer ones run through red
+ * and yellow down to a dark blue. The graticule is drawn in grey where
+ * nothing was hit. */
+static void colour(const struct persist *p, int x, int y, uint8_t *rgb)
+{
+	unsigned hits = p->hits[y][x / PERSIST_LANES][x % PERSIST_LANES];
+
+	if (!hits) {
+		int gx = x - 10;
+		int gy = y - 10 - 64;
+		int grid = gx >= 0 && gx <= 500 && gy >= 0 && gy <= 480 &&
+			(gx % 50 == 0 || gy % 60 == 0);
+
+		memset(rgb, grid ? 64 : 0, 3);
+		return;
+	}
+
+	static const uint8_t stops [][3] = {
+		{0, 0, 128}, {0, 160, 255}, {255, 0, 0}, {255, 255, 0},
+		{255, 255, 255},
+	};
+	static const int last = sizeof(stops) / sizeof(*stops) - 1;
+	double t = (double) hits / MAX(MIN(p->captures, UINT16_MAX), 1) * last;
+	int i = MIN((int) t, last - 1);
+	double f = MIN(t - i, 1);
+
+	for (int c = 0; c < 3; c++) {
+		rgb[c] = stops[i][c] + (stops[i + 1][c] - stops[i][c]) * f;
+	}
+}
+
+static int chunk(FILE *f, const char *type, const uint8_t *data, uint32_t len)
+{
+	uint8_t head [8] = {len >> 24, len >> 16, len >> 8, len};
+	uLong crc;
+
+	memcpy(head + 4, type, 4);
+	crc = crc32(0, head + 4, 4);
+
+	if (len) {
+		crc = crc32(crc, data, len);
+	}
+
+	uint8_t tail [4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+
+	return fwrite(head, 1, 8, f) == 8 &&
+		(!len || fwrite(data, 1, len, f) == len) &&
+		fwrite(tail, 1, 4, f) == 4 ? 0 : -1;
+}
+
+/* Written to a temporary file that then replaces path, so that a viewer
+ * never sees a partly written image */
+int persist_write_png(const struct persist *p, const char *path)
+{
+	static const uint8_t signature [8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+	static const uint8_t header [13] = {
+		PERSIST_WIDTH >> 24, PERSIST_WIDTH >> 16, PERSIST_WIDTH >> 8,
+		PERSIST_WIDTH & 0xFF,
+		PERSIST_HEIGHT >> 24, PERSIST_HEIGHT >> 16, PERSIST_HEIGHT >> 8,
+		PERSIST_HEIGHT & 0xFF,
+		8, 2, 0, 0, 0, /* 8 bit RGB */
+	};
+	size_t row = 1 + PERSIST_WIDTH * 3;
+	size_t raw_len = row * PERSIST_HEIGHT;
+	uLongf len = compressBound(raw_len);
+	uint8_t *raw = malloc(raw_len);
+	uint8_t *z = malloc(len);
+	char tmp [4096];
+	FILE *f = 0;
+	int r = -1;
+
+	if (!raw || !z) {
+		fprintf(stderr, "Out of memory\n");
+		goto exit;
+	}
+
+	for (int y = 0; y < PERSIST_HEIGHT; y++) {
+		raw[y * row] = 0; /* no filter */
+
+		for (int x = 0; x < PERSIST_WIDTH; x++) {
+			colour(p, x, y, raw + y * row + 1 + x * 3);
+		}
+	}
+
+	if (compress2(z, &len, raw, raw_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		fprintf(stderr, "Failed to compress the image\n");
+		goto exit;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	if (!(f = fopen(tmp, "wb"))) {
+		perror(tmp);
+		goto exit;
+	}
+
+	if (fwrite(signature, 1, 8, f) != 8 ||
+			chunk(f, "IHDR", header, sizeof(header)) < 0 ||
+			chunk(f, "IDAT", z, len) < 0 || chunk(f, "IEND", 0, 0) < 0) {
+		perror(tmp);
+		goto exit;
+	}
+
+	if (fclose(f)) {
+		f = 0;
+		perror(tmp);
+		goto exit;
+	}
+
+	f = 0;
+
+	if (rename(tmp, path) < 0) {
+		perror(path);
+		goto exit;
+	}
+
+	r = 0;
+exit:
+	if (f) {
+		fclose(f);
+		remove(tmp);
+	}
+
+	free(raw);
+	free(z);
+
+	return r;
+}
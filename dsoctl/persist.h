@@ -0,0 +1,55 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include "ops.h"
+#include <stdint.h>
+
+/* Persistence display: how many captures drew each pixel of the SVG's view
+ * box, kept over any number of captures and exported as a colour mapped
+ * PNG. A capture is first drawn into a mask, so that it counts once per
+ * pixel however often it crosses it, and the mask is then added to the
+ * counts with saturating vector adds. */
+#define PERSIST_WIDTH 700
+#define PERSIST_HEIGHT 578
+
+typedef uint16_t persist_vec __attribute__((vector_size(16)));
+
+#define PERSIST_LANES ((int) (sizeof(persist_vec) / sizeof(uint16_t)))
+#define PERSIST_STRIDE ((PERSIST_WIDTH + PERSIST_LANES - 1) / PERSIST_LANES)
+
+struct persist {
+	persist_vec hits [PERSIST_HEIGHT][PERSIST_STRIDE];
+	persist_vec mark [PERSIST_HEIGHT][PERSIST_STRIDE];
+	int top;
+	int bottom;
+	int captures;
+
+	int in_line;
+	int last_x;
+	int last_y;
+};
+
+void persist_init(struct persist *p);
+void persist_op(void *ctx, const struct op *op);
+int persist_write_png(const struct persist *p, const char *path);
+
+#endif /* PERSIST_H */
@@ -0,0 +1,367 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "preview.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+/* Offsets of the SVG's view box, in framebuffer pixels */
+#define LEFT 5
+#define TOP 5
+
+enum {
+	COLOR_BACKGROUND,
+	COLOR_GRID,
+	COLOR_BLACK,
+	COLOR_GREEN,
+	COLOR_BLUE,
+	COLOR_COUNT,
+};
+
+static const uint8_t palette [COLOR_COUNT][3] = {
+	{255, 255, 255},
+	{192, 192, 192},
+	{0, 0, 0},
+	{0, 128, 0},
+	{0, 0, 255},
+};
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define CLAMP(x, a, b) (MIN(MAX(x, a), b))
+
+int preview_protocol(const char *name)
+{
+	if (strcmp(name, "sixel") == 0) {
+		return PREVIEW_SIXEL;
+	}
+
+	if (strcmp(name, "kitty") == 0) {
+		return PREVIEW_KITTY;
+	}
+
+	return -1;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int color(struct preview *p)
+{
+	switch (p->pen) {
+	case 2:
+		return COLOR_GREEN;
+	case 3:
+		return COLOR_BLUE;
+	default:
+		return COLOR_BLACK;
+	}
+}
+
+/* Plotter coordinates to framebuffer pixels, as the SVG maps them */
+static int px(int x)
+{
+	return CLAMP(LEFT + x / 2, 0, PREVIEW_WIDTH - 1);
+}
+
+static int py(int y)
+{
+	return TOP + 280 - CLAMP(y, 0, 280);
+}
+
+static void line(struct preview *p, int x0, int y0, int x1, int y1, int c)
+{
+	int dx = abs(x1 - x0);
+	int dy = -abs(y1 - y0);
+	int sx = x0 < x1 ? 1 : -1;
+	int sy = y0 < y1 ? 1 : -1;
+	int err = dx + dy;
+
+	for (;;) {
+		p->fb[y0][x0] = c;
+
+		if (x0 == x1 && y0 == y1) {
+			break;
+		}
+
+		int e2 = 2 * err;
+
+		if (e2 >= dy) {
+			err += dy;
+			x0 += sx;
+		}
+
+		if (e2 <= dx) {
+			err += dx;
+			y0 += sy;
+		}
+	}
+}
+
+static void graticule(struct preview *p)
+{
+	memset(p->fb, COLOR_BACKGROUND, sizeof(p->fb));
+
+	for (int x = 0; x <= 500; x += 50) {
+		line(p, LEFT + x / 2, TOP + 32, LEFT + x / 2, TOP + 272, COLOR_GRID);
+	}
+
+	for (int y = 64; y <= 544; y += 60) {
+		line(p, LEFT, TOP + y / 2, LEFT + 250, TOP + y / 2, COLOR_GRID);
+	}
+}
+
+static void point(struct preview *p, int x, int y)
+{
+	x = px(x);
+	y = py(y);
+
+	if (p->in_line) {
+		line(p, p->last_x, p->last_y, x, y, color(p));
+	} else {
+		p->fb[y][x] = color(p);
+	}
+
+	p->in_line = 1;
+	p->last_x = x;
+	p->last_y = y;
+	p->dirty = 1;
+}
+
+void preview_init(struct preview *p, FILE *out, int protocol)
+{
+	memset(p, 0, sizeof(*p));
+	p->out = out;
+	p->protocol = protocol;
+	graticule(p);
+}
+
+/* Labels are left out, as the framebuffer has no font */
+void preview_op(void *ctx, const struct op *op)
+{
+	struct preview *p = ctx;
+
+	switch (op->code) {
+	case OP_BEGIN:
+		graticule(p);
+		p->pen = 0;
+		p->in_line = 0;
+		p->dirty = 1;
+		break;
+	case OP_END:
+		/* The finished capture is always shown */
+		p->drawn = 0;
+		p->dirty = 1;
+		preview_update(p);
+		break;
+	case OP_PEN:
+		p->pen = op->arg[0];
+		break;
+	case OP_POINT:
+		point(p, op->arg[0], op->arg[1]);
+		break;
+	case OP_RUN:
+		for (int i = 0; i < op->count; i++) {
+			point(p, op->x[i], op->y[i]);
+		}
+		break;
+	case OP_LINE:
+		p->in_line = 0;
+		point(p, op->arg[0], op->arg[1]);
+		point(p, op->arg[2], op->arg[3]);
+		p->in_line = 0;
+		break;
+	case OP_MARKER:
+		for (int i = -1; i <= 1; i++) {
+			int x = CLAMP(px(op->arg[0]) + i, 0, PREVIEW_WIDTH - 1);
+
+			for (int j = -1; j <= 1; j++) {
+				p->fb[CLAMP(py(op->arg[1]) + j, 0, PREVIEW_HEIGHT - 1)][x] =
+					COLOR_BLACK;
+			}
+		}
+
+		p->dirty = 1;
+		break;
+	case OP_POLYLINE:
+	case OP_POLYLINE_END:
+	case OP_RESYNC:
+		p->in_line = 0;
+		break;
+	}
+}
+
+static void sixel_run(FILE *out, int ch, int n)
+{
+	if (n > 3) {
+		fprintf(out, "!%d%c", n, ch);
+		return;
+	}
+
+	while (n--) {
+		fputc(ch, out);
+	}
+}
+
+/* Each band of six rows is sent once per colour it uses, with the sixels
+ * of the other colours left transparent */
+static void draw_sixel(struct preview *p)
+{
+	FILE *out = p->out;
+
+	fprintf(out, "\033P0;1q\"1;1;%d;%d", PREVIEW_WIDTH, PREVIEW_HEIGHT);
+
+	for (int c = 0; c < COLOR_COUNT; c++) {
+		fprintf(out, "#%d;2;%d;%d;%d", c, palette[c][0] * 100 / 255,
+				palette[c][1] * 100 / 255, palette[c][2] * 100 / 255);
+	}
+
+	for (int band = 0; band < PREVIEW_HEIGHT; band += 6) {
+		int rows = MIN(6, PREVIEW_HEIGHT - band);
+
+		for (int c = 0; c < COLOR_COUNT; c++) {
+			int used = 0;
+			int run_ch = 63;
+			int run = 0;
+
+			for (int x = 0; x <= PREVIEW_WIDTH; x++) {
+				int bits = 0;
+
+				for (int i = 0; x < PREVIEW_WIDTH && i < rows; i++) {
+					bits |= (p->fb[band + i][x] == c) << i;
+				}
+
+				int ch = 63 + bits;
+
+				/* The column past the end flushes the last run. A run of
+				 * nothing is only sent when something follows it. */
+				if (ch != run_ch || x == PREVIEW_WIDTH) {
+					if (run_ch != 63 || x < PREVIEW_WIDTH) {
+						if (!used) {
+							fprintf(out, "#%d", c);
+							used = 1;
+						}
+
+						sixel_run(out, run_ch, run);
+					}
+
+					run_ch = ch;
+					run = 0;
+				}
+
+				run++;
+			}
+
+			if (used) {
+				fputc('$', out);
+			}
+		}
+
+		fputc('-', out);
+	}
+
+	fputs("\033\\", out);
+}
+
+static const char base64 [] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* The kitty protocol takes the pixels as zlib compressed RGB in chunks of
+ * at most 4096 base64 characters. The image keeps its id, so each frame
+ * replaces the last. */
+static void draw_kitty(struct preview *p)
+{
+	static const size_t raw_len = PREVIEW_WIDTH * PREVIEW_HEIGHT * 3;
+	uint8_t *rgb = malloc(raw_len);
+	uLongf len = compressBound(raw_len);
+	uint8_t *z = malloc(len);
+
+	if (!rgb || !z) {
+		goto exit;
+	}
+
+	for (int y = 0; y < PREVIEW_HEIGHT; y++) {
+		for (int x = 0; x < PREVIEW_WIDTH; x++) {
+			memcpy(rgb + (y * PREVIEW_WIDTH + x) * 3, palette[p->fb[y][x]], 3);
+		}
+	}
+
+	if (compress2(z, &len, rgb, raw_len, 1) != Z_OK) {
+		goto exit;
+	}
+
+	for (size_t i = 0; i < len; i += 3072) {
+		size_t end = MIN(i + 3072, len);
+
+		if (i == 0) {
+			fprintf(p->out, "\033_Ga=T,i=1,f=24,s=%d,v=%d,o=z,q=2,C=1,m=%d;",
+					PREVIEW_WIDTH, PREVIEW_HEIGHT, end < len);
+		} else {
+			fprintf(p->out, "\033_Gm=%d;", end < len);
+		}
+
+		for (size_t j = i; j < end; j += 3) {
+			uint32_t v = z[j] << 16 | (j + 1 < end ? z[j + 1] << 8 : 0) |
+				(j + 2 < end ? z[j + 2] : 0);
+
+			fputc(base64[v >> 18], p->out);
+			fputc(base64[(v >> 12) & 63], p->out);
+			fputc(j + 1 < end ? base64[(v >> 6) & 63] : '=', p->out);
+			fputc(j + 2 < end ? base64[v & 63] : '=', p->out);
+		}
+
+		fputs("\033\\", p->out);
+	}
+
+exit:
+	free(rgb);
+	free(z);
+}
+
+/* Redraws the preview if it has changed and the last frame is old enough */
+void preview_update(struct preview *p)
+{
+	double t;
+
+	if (!p->dirty || ((t = now()) - p->drawn < 1.0 / PREVIEW_FPS)) {
+		return;
+	}
+
+	/* Each frame is drawn where the first was */
+	fputs(p->shown ? "\0338" : "\0337", p->out);
+	p->shown = 1;
+
+	if (p->protocol == PREVIEW_KITTY) {
+		draw_kitty(p);
+	} else {
+		draw_sixel(p);
+	}
+
+	fflush(p->out);
+	p->dirty = 0;
+	p->drawn = t;
+}
@@ -0,0 +1,58 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "ops.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/* Live preview of a capture in the terminal. Drawing operations are
+ * rasterised into a framebuffer as they arrive, at half the scale of the
+ * SVG, and the framebuffer is redrawn in place as a sixel or kitty graphics
+ * image whenever it has changed, at most PREVIEW_FPS times a second. */
+#define PREVIEW_WIDTH 350
+#define PREVIEW_HEIGHT 289
+#define PREVIEW_FPS 20
+
+enum {
+	PREVIEW_SIXEL,
+	PREVIEW_KITTY,
+};
+
+struct preview {
+	FILE *out;
+	int protocol;
+	int pen;
+	int last_x;
+	int last_y;
+	int in_line;
+	int dirty;
+	int shown;
+	double drawn;
+	uint8_t fb [PREVIEW_HEIGHT][PREVIEW_WIDTH];
+};
+
+int preview_protocol(const char *name);
+void preview_init(struct preview *p, FILE *out, int protocol);
+void preview_op(void *ctx, const struct op *op);
+void preview_update(struct preview *p);
+
+#endif /* PREVIEW_H */
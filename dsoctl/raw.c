@@ -0,0 +1,52 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "raw.h"
+
+static void push(struct hpgl *h, uint8_t type, int16_t value)
+{
+	hpgl_token(h, type, value);
+}
+
+static void emit(struct hpgl *h, const void *data, uint8_t len)
+{
+	struct raw *raw = h->ctx;
+
+	op_decoder_feed(raw->dec, data, len);
+}
+
+void raw_init(struct raw *raw, struct op_decoder *dec)
+{
+	hpgl_init(&raw->hpgl, push, emit, raw);
+	raw->dec = dec;
+}
+
+void raw_feed(struct raw *raw, const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		hpgl_lex(&raw->hpgl, data[i]);
+	}
+}
+
+/* Restarts lexing at the next command after the device dropped input */
+void raw_resync(struct raw *raw)
+{
+	raw->hpgl.lexer = (struct hpgl_lexer) {0};
+	hpgl_token(&raw->hpgl, TOKEN_RESYNC, 0);
+}
@@ -0,0 +1,37 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef RAW_H
+#define RAW_H
+
+#include "hpgl.h"
+#include "ops.h"
+
+/* Converts raw HPGL on the host, using the converter from stm32/hpgl.c. The
+ * resulting drawing operations are passed to dec. */
+struct raw {
+	struct hpgl hpgl;
+	struct op_decoder *dec;
+};
+
+void raw_init(struct raw *raw, struct op_decoder *dec);
+void raw_feed(struct raw *raw, const uint8_t *data, size_t len);
+void raw_resync(struct raw *raw);
+
+#endif /* RAW_H */
@@ -0,0 +1,314 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "spectrum.h"
+#include <math.h>
+#include <string.h>
+
+#define HALF (SPECTRUM_SIZE / 2)
+
+void spectrum_init(struct spectrum *s)
+{
+	int bits = 0;
+
+	memset(s, 0, sizeof(*s));
+	measure_init(&s->measure);
+
+	while ((1 << bits) < HALF) {
+		bits++;
+	}
+
+	for (int i = 0; i < HALF; i++) {
+		int r = 0;
+
+		for (int b = 0; b < bits; b++) {
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		}
+
+		s->reverse[i] = r;
+	}
+
+	for (int i = 0; i < HALF / 2; i++) {
+		s->twiddle_re[i] = cos(-2 * M_PI * i / HALF);
+		s->twiddle_im[i] = sin(-2 * M_PI * i / HALF);
+	}
+
+	for (int i = 0; i < HALF; i++) {
+		s->post_re[i] = cos(-2 * M_PI * i / SPECTRUM_SIZE);
+		s->post_im[i] = sin(-2 * M_PI * i / SPECTRUM_SIZE);
+	}
+}
+
+void spectrum_op(void *ctx, const struct op *op)
+{
+	struct spectrum *s = ctx;
+
+	measure_op(&s->measure, op);
+}
+
+static void set_window(struct spectrum *s, int len)
+{
+	s->window_len = len;
+	s->window_sum = 0;
+
+	for (int i = 0; i < len; i++) {
+		s->window[i] = len > 1 ? 0.5 - 0.5 * cos(2 * M_PI * i / (len - 1)) : 1;
+		s->window_sum += s->window[i];
+	}
+}
+
+/* In place, iterative radix-2 decimation in time over HALF points */
+static void fft(const struct spectrum *s, float *re, float *im)
+{
+	for (int i = 0; i < HALF; i++) {
+		int j = s->reverse[i];
+
+		if (i < j) {
+			float t = re[i];
+
+			re[i] = re[j];
+			re[j] = t;
+			t = im[i];
+			im[i] = im[j];
+			im[j] = t;
+		}
+	}
+
+	for (int len = 2; len <= HALF; len <<= 1) {
+		int half = len / 2;
+		int step = HALF / len;
+
+		for (int i = 0; i < HALF; i += len) {
+			for (int j = 0; j < half; j++) {
+				float wr = s->twiddle_re[j * step];
+				float wi = s->twiddle_im[j * step];
+				int a = i + j;
+				int b = a + half;
+				float tr = wr * re[b] - wi * im[b];
+				float ti = wr * im[b] + wi * re[b];
+
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
+
+/* Samples of a channel in volts, with holes in the trace filled by the
+ * previous column. Returns the number of columns the trace spans. */
+static int samples(struct spectrum *s, int channel, float *x)
+{
+	const struct mask_trace *t = &s->measure.trace[channel];
+	double vpd = s->measure.volts_per_div[channel];
+	double scale = (vpd ? vpd : 1) / MEASURE_DIV_Y / 2;
+	int first = -1;
+	int last = -1;
+
+	for (int i = 0; i < SPECTRUM_SIZE; i++) {
+		if (t->lo[i / MASK_LANES][i % MASK_LANES] <=
+				t->hi[i / MASK_LANES][i % MASK_LANES]) {
+			first = first < 0 ? i : first;
+			last = i;
+		}
+	}
+
+	if (first < 0) {
+		return 0;
+	}
+
+	float prev = 0;
+
+	for (int i = first; i <= last; i++) {
+		int lo = t->lo[i / MASK_LANES][i % MASK_LANES];
+		int hi = t->hi[i / MASK_LANES][i % MASK_LANES];
+
+		if (lo <= hi) {
+			prev = (lo + hi - 2 * MEASURE_CENTRE_Y) * scale;
+		}
+
+		x[i - first] = prev;
+	}
+
+	return last - first + 1;
+}
+
+void spectrum_compute(struct spectrum *s)
+{
+	double spd = s->measure.secs_per_div;
+
+	s->bin_width = 1 / ((spd ? spd : 1) / MEASURE_DIV_X) / SPECTRUM_SIZE;
+
+	for (int c = 0; c < MEASURE_CHANNELS; c++) {
+		float x [SPECTRUM_SIZE] = {0};
+		float re [HALF];
+		float im [HALF];
+		float *mag = s->magnitude[c];
+		int len = samples(s, c, x);
+
+		s->have[c] = len > 1;
+
+		if (!s->have[c]) {
+			memset(mag, 0, sizeof(s->magnitude[c]));
+			continue;
+		}
+
+		if (len != s->window_len) {
+			set_window(s, len);
+		}
+
+		/* The mean is taken out before windowing, so that it does not
+		 * leak into the lowest bins, and given as the DC bin */
+		double mean = 0;
+
+		for (int i = 0; i < len; i++) {
+			mean += x[i];
+		}
+
+		mean /= len;
+
+		for (int i = 0; i < len; i++) {
+			x[i] = (x[i] - mean) * s->window[i];
+		}
+
+		/* Even samples as the real part, odd as the imaginary */
+		for (int i = 0; i < HALF; i++) {
+			re[i] = x[2 * i];
+			im[i] = x[2 * i + 1];
+		}
+
+		fft(s, re, im);
+
+		/* Scaled to the peak amplitude of a sine, which the window's sum
+		 * halves */
+		double scale = 2 / s->window_sum;
+
+		mag[0] = fabs(mean);
+		mag[HALF] = fabs(re[0] - im[0]) * scale / 2;
+
+		for (int k = 1; k < HALF; k++) {
+			float ar = re[k], ai = im[k];
+			float br = re[HALF - k], bi = -im[HALF - k];
+			float er = (ar + br) / 2, ei = (ai + bi) / 2;
+			float dr = (ai - bi) / 2, di = -(ar - br) / 2;
+			float xr = er + s->post_re[k] * dr - s->post_im[k] * di;
+			float xi = ei + s->post_re[k] * di + s->post_im[k] * dr;
+
+			mag[k] = sqrtf(xr * xr + xi * xi) * scale;
+		}
+	}
+}
+
+void spectrum_write_csv_header(FILE *out)
+{
+	fputs("capture,channel,frequency,magnitude\n", out);
+}
+
+void spectrum_write_csv(FILE *out, const struct spectrum *s, int capture)
+{
+	for (int c = 0; c < MEASURE_CHANNELS; c++) {
+		if (!s->have[c]) {
+			continue;
+		}
+
+		for (int k = 0; k < SPECTRUM_BINS; k++) {
+			fprintf(out, "%d,%d,%g,%g\n", capture, c + 1, k * s->bin_width,
+					s->magnitude[c][k]);
+		}
+	}
+}
+
+/* The plot is 512 wide with a bin every 2 units, and 80 dB high at 3
+ * units per dB, below the top dB that is a multiple of 10 above the
+ * highest bin */
+#define PLOT_WIDTH 512
+#define PLOT_HEIGHT 240
+#define PLOT_RANGE 80
+
+static double db(double v)
+{
+	return v > 0 ? 20 * log10(v) : -1000;
+}
+
+void spectrum_write_svg(FILE *out, const struct spectrum *s, int capture)
+{
+	static const char *colors [MEASURE_CHANNELS] = {"green", "blue"};
+	double peak = -1000;
+
+	for (int c = 0; c < MEASURE_CHANNELS; c++) {
+		for (int k = 0; s->have[c] && k < SPECTRUM_BINS; k++) {
+			peak = fmax(peak, db(s->magnitude[c][k]));
+		}
+	}
+
+	double top = peak > -1000 ? ceil(peak / 10) * 10 : 0;
+	const char *unit = s->measure.secs_per_div ? "Hz" : "/div";
+
+	fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
+			"<svg width=\"600\" height=\"300\" viewBox=\"-60 -20 600 300\" "
+			"xmlns=\"http://www.w3.org/2000/svg\">\n"
+			"<rect width=\"%d\" height=\"%d\" fill=\"none\" stroke=\"black\" "
+			"stroke-width=\"0.2\" />\n", PLOT_WIDTH, PLOT_HEIGHT);
+	fprintf(out, "<text x=\"0\" y=\"-6\" font-family=\"mono\" font-size=\"12\">"
+			"Capture %d, peak amplitude in %s</text>\n", capture,
+			s->measure.volts_per_div[0] || s->measure.volts_per_div[1] ?
+			"dBV" : "dB of a division");
+
+	for (int i = 0; i <= PLOT_RANGE; i += 10) {
+		int y = i * PLOT_HEIGHT / PLOT_RANGE;
+
+		fprintf(out, "<path d=\"M 0 %d L %d %d\" stroke=\"black\" "
+				"stroke-width=\"0.2\" />\n", y, PLOT_WIDTH, y);
+		fprintf(out, "<text x=\"-4\" y=\"%d\" font-family=\"mono\" "
+				"font-size=\"10\" text-anchor=\"end\">%g</text>\n", y + 3,
+				top - i);
+	}
+
+	for (int i = 0; i <= 4; i++) {
+		int x = i * PLOT_WIDTH / 4;
+
+		fprintf(out, "<path d=\"M %d 0 L %d %d\" stroke=\"black\" "
+				"stroke-width=\"0.2\" />\n", x, x, PLOT_HEIGHT);
+		fprintf(out, "<text x=\"%d\" y=\"%d\" font-family=\"mono\" "
+				"font-size=\"10\" text-anchor=\"middle\">%g%s</text>\n", x,
+				PLOT_HEIGHT + 14, i * (SPECTRUM_BINS - 1) / 4 * s->bin_width,
+				unit);
+	}
+
+	for (int c = 0; c < MEASURE_CHANNELS; c++) {
+		if (!s->have[c]) {
+			continue;
+		}
+
+		fprintf(out, "<polyline stroke=\"%s\" stroke-width=\"1\" fill=\"none\" "
+				"points=\"", colors[c]);
+
+		for (int k = 0; k < SPECTRUM_BINS; k++) {
+			double v = fmin(fmax(top - db(s->magnitude[c][k]), 0), PLOT_RANGE);
+
+			fprintf(out, "%d,%.1f ", k * PLOT_WIDTH / (SPECTRUM_BINS - 1),
+					v * PLOT_HEIGHT / PLOT_RANGE);
+		}
+
+		fputs("\" />\n", out);
+	}
+
+	fputs("</svg>\n", out);
+}
@@ -0,0 +1,67 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include "measure.h"
+#include "ops.h"
+#include <stdio.h>
+
+/* Magnitude spectra of both channels. The traces and scales are collected
+ * as for measuring; the trace's columns are the samples, and the sample
+ * rate follows from the time per division label.
+ *
+ * Each channel is Hann windowed and transformed with a real FFT of
+ * SPECTRUM_SIZE points, done as a complex radix-2 FFT of half the size.
+ * The twiddle factors and bit reversal are computed once, in spectrum_init,
+ * and reused for every capture. */
+#define SPECTRUM_SIZE MASK_WIDTH
+#define SPECTRUM_BINS (SPECTRUM_SIZE / 2 + 1)
+
+struct spectrum {
+	struct measure measure;
+
+	float window [SPECTRUM_SIZE];
+	float twiddle_re [SPECTRUM_SIZE / 4];
+	float twiddle_im [SPECTRUM_SIZE / 4];
+	float post_re [SPECTRUM_SIZE / 2];
+	float post_im [SPECTRUM_SIZE / 2];
+	uint16_t reverse [SPECTRUM_SIZE / 2];
+
+	/* Peak amplitude of each bin, 0 for a channel without a trace */
+	float magnitude [MEASURE_CHANNELS][SPECTRUM_BINS];
+	int have [MEASURE_CHANNELS];
+	double bin_width;
+
+	/* The window covers the columns a trace spans and the rest is zero
+	 * padded, so it is recomputed when the span changes */
+	int window_len;
+	double window_sum;
+};
+
+void spectrum_init(struct spectrum *s);
+void spectrum_op(void *ctx, const struct op *op);
+void spectrum_compute(struct spectrum *s);
+
+void spectrum_write_csv_header(FILE *out);
+void spectrum_write_csv(FILE *out, const struct spectrum *s, int capture);
+void spectrum_write_svg(FILE *out, const struct spectrum *s, int capture);
+
+#endif /* SPECTRUM_H */
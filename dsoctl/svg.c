@@ -0,0 +1,229 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "svg.h"
+#include "common.h"
+
+static const char *header = "\
+<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n\
+<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" \"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n\
+<svg width=\"700\" height=\"578\" viewBox=\"-10 -10 700 578\" xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\">\n";
+
+/* Attributes shared by every element of a kind are set once in the style
+ * sheet, so that plots with many labels and markers stay small */
+static const char *graticule = "\
+<style>\n\
+polyline{fill:none;stroke-width:1}\n\
+text{font-family:mono;font-size:14px}\n\
+.p2{fill:green}\n\
+.p3{fill:blue}\n\
+.m{stroke:black;stroke-width:2;stroke-linecap:round}\n\
+</style>\n\
+<defs>\n\
+<pattern id=\"grid\" width=\"50\" height=\"60\" y=\"64\" patternUnits=\"userSpaceOnUse\">\n\
+<path d=\"M 50 0 L 0 0 0 60\" fill=\"none\" stroke=\"black\" stroke-width=\"0.2\"/>\n\
+</pattern>\n\
+<pattern id=\"xaxis\" width=\"10\" height=\"8\" patternUnits=\"userSpaceOnUse\">\n\
+<path d=\"M 0 0 L 0 8\" fill=\"none\" stroke=\"black\" stroke-width=\"0.2\"/>\n\
+</pattern>\n\
+<pattern id=\"yaxis\" width=\"8\" height=\"12\" y=\"64\" patternUnits=\"userSpaceOnUse\">\n\
+<path d=\"M 0 0 L 8 0\" fill=\"none\" stroke=\"black\" stroke-width=\"0.2\"/>\n\
+</pattern>\n\
+</defs>\n\
+<rect width=\"500\" height=\"480\" y=\"64\" fill=\"none\" stroke=\"black\" stroke-width=\"0.2\" />\n\
+<rect width=\"500\" height=\"480\" y=\"64\" fill=\"url(#grid)\" />\n\
+<rect y=\"300\" width=\"500\" height=\"8\" fill=\"url(#xaxis)\" />\n\
+<rect x=\"246\" y=\"64\" width=\"8\" height=\"480\" fill=\"url(#yaxis)\" />\n";
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define CLAMP(x, a, b) (MIN(MAX(x, a), b))
+#define Y(y) CLAMP((560 - (y) * 2), 0, 560)
+
+void svg_init(struct svg *svg, FILE *out)
+{
+	svg->out = out;
+	svg->pen = 0;
+	svg->line_type = 0;
+	svg->done = 0;
+	svg->capture = 0;
+	svg->element = ELEMENT_NONE;
+}
+
+static const char *color(struct svg *svg)
+{
+	switch (svg->pen) {
+	case 2:
+		return "green";
+	case 3:
+		return "blue";
+	default:
+		return "black";
+	}
+}
+
+/* Consecutive markers are drawn as dots of a single path, each a zero
+ * length subpath with round caps */
+static void marker(struct svg *svg, int x, int y)
+{
+	if (svg->element != ELEMENT_MARKERS) {
+		fputs("<path class=\"m\" d=\"", svg->out);
+		svg->element = ELEMENT_MARKERS;
+	} else {
+		fputc(' ', svg->out);
+	}
+
+	fprintf(svg->out, "M%d %dh0", x, y);
+}
+
+static void line_start(struct svg *svg)
+{
+	fprintf(svg->out, "<polyline stroke=\"%s\" ", color(svg));
+
+	switch (svg->line_type) {
+	case 2:
+		fputs("stroke-dasharray=\"10 10\" ", svg->out);
+		break;
+	}
+
+	fputs("points=\"", svg->out);
+	svg->element = ELEMENT_POLYLINE;
+}
+
+static void line_end(struct svg *svg)
+{
+	fputs("\" />\n", svg->out);
+	svg->element = ELEMENT_NONE;
+}
+
+static void close_element(struct svg *svg)
+{
+	switch (svg->element) {
+	case ELEMENT_POLYLINE:
+		line_end(svg);
+		break;
+	case ELEMENT_TEXT:
+		fputs("</text>\n", svg->out);
+		break;
+	case ELEMENT_MARKERS:
+		fputs("\" />\n", svg->out);
+		break;
+	}
+
+	svg->element = ELEMENT_NONE;
+}
+
+void svg_gap(struct svg *svg)
+{
+	if (!svg->capture) {
+		return;
+	}
+
+	close_element(svg);
+	fputs("<!-- data lost, resynchronised -->\n", svg->out);
+}
+
+void svg_op(void *ctx, const struct op *op)
+{
+	struct svg *svg = ctx;
+	FILE *out = svg->out;
+
+	if (svg->element == ELEMENT_MARKERS && op->code != OP_MARKER) {
+		close_element(svg);
+	}
+
+	switch (op->code) {
+	case OP_BEGIN:
+		if (svg->capture) {
+			fprintf(stderr, "Capture ended without OP_END\n");
+			close_element(svg);
+			fputs("</svg>\n", out);
+		}
+
+		/* The device sends OP_LINE_TYPE only when the type changes within
+		 * a capture and starts each one from the default, so a type left
+		 * over from the previous capture would dash the wrong lines */
+		fputs(header, out);
+		fputs(graticule, out);
+		svg->pen = 0;
+		svg->line_type = 0;
+		svg->capture = 1;
+		break;
+	case OP_END:
+		close_element(svg);
+		fputs("</svg>\n", out);
+		svg->pen = 0;
+		svg->capture = 0;
+		svg->done = 1;
+		break;
+	case OP_PEN:
+		svg->pen = op->arg[0];
+		break;
+	case OP_LINE_TYPE:
+		svg->line_type = op->arg[0];
+		break;
+	case OP_POLYLINE:
+		line_start(svg);
+		break;
+	case OP_POINT:
+		fprintf(out, "%d,%d ", op->arg[0], Y(op->arg[1]));
+		break;
+	case OP_RUN:
+		for (int i = 0; i < op->count; i++) {
+			fprintf(out, "%d,%d ", op->x[i], Y(op->y[i]));
+		}
+		break;
+	case OP_POLYLINE_END:
+		line_end(svg);
+		break;
+	case OP_LINE:
+		line_start(svg);
+		fprintf(out, "%d,%d %d,%d", op->arg[0], Y(op->arg[1]),
+				op->arg[2], Y(op->arg[3]));
+		line_end(svg);
+		break;
+	case OP_MARKER:
+		marker(svg, op->arg[0], Y(op->arg[1]));
+		break;
+	case OP_LABEL:
+		fprintf(out, "<text x=\"%d\" y=\"%d\"", op->arg[0] + 3,
+				Y(op->arg[1]) + 5);
+
+		if (svg->pen == 2 || svg->pen == 3) {
+			fprintf(out, " class=\"p%d\"", svg->pen);
+		}
+
+		fputc('>', out);
+		svg->element = ELEMENT_TEXT;
+		break;
+	case OP_LABEL_END:
+		fputs("</text>\n", out);
+		svg->element = ELEMENT_NONE;
+		break;
+	case OP_RESYNC:
+		close_element(svg);
+		fputs("<!-- input overflow, resynchronised -->\n", out);
+		fprintf(stderr, "Device dropped input after an overflow\n");
+		break;
+	default:
+		if (op->code >= OP_TEXT) {
+			fputc(op->code, out);
+		}
+	}
+}
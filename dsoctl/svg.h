@@ -0,0 +1,48 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef SVG_H
+#define SVG_H
+
+#include "ops.h"
+#include <stdio.h>
+
+enum {
+	ELEMENT_NONE,
+	ELEMENT_POLYLINE,
+	ELEMENT_TEXT,
+	ELEMENT_MARKERS,
+};
+
+struct svg {
+	FILE *out;
+	int pen;
+	int line_type;
+	int capture;
+	int element;
+	int done;
+};
+
+void svg_init(struct svg *svg, FILE *out);
+void svg_op(void *ctx, const struct op *op);
+
+/* Closes any element left open after data was lost in transit */
+void svg_gap(struct svg *svg);
+
+#endif /* SVG_H */
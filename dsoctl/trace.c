@@ -0,0 +1,158 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "trace.h"
+#include <stddef.h>
+#include <string.h>
+
+void trace_dump_init(struct trace_dump *dump)
+{
+	memset(dump, 0, sizeof(*dump));
+}
+
+int trace_dump_packet(struct trace_dump *dump,
+		const struct usb_packet_trace *packet)
+{
+	int n = (packet->length - offsetof(struct usb_packet_trace, events)) /
+		sizeof(struct trace_event);
+
+	if (packet->index == 0) {
+		dump->received = 0;
+	}
+
+	if (packet->index != dump->received ||
+			dump->received + n > TRACE_DUMP_MAX) {
+		return -1;
+	}
+
+	memcpy(dump->events + dump->received, packet->events,
+			n * sizeof(struct trace_event));
+	dump->received += n;
+	dump->total = packet->total;
+	dump->complete = dump->received >= dump->total;
+	return 0;
+}
+
+enum {
+	TID_CAPTURE = 1,
+	TID_PARSER,
+	TID_USB,
+};
+
+static const char *thread_names [] = {
+	[TID_CAPTURE] = "capture",
+	[TID_PARSER] = "parser",
+	[TID_USB] = "usb",
+};
+
+/* Finds the event ending the one at i, or -1 if it is not in the trace */
+static int find_end(const struct trace_event *events, int count, int i)
+{
+	for (int j = i + 1; j < count; j++) {
+		switch (events[i].type) {
+		case TRACE_COMMAND:
+			if (events[j].type == TRACE_COMMAND ||
+					events[j].type == TRACE_CAPTURE_END) {
+				return j;
+			}
+			break;
+		case TRACE_USB_SUBMIT:
+			if (events[j].type == TRACE_USB_COMPLETE &&
+					events[j].value == events[i].value) {
+				return j;
+			}
+			break;
+		}
+	}
+
+	return -1;
+}
+
+void trace_write_json(FILE *out, const struct trace_event *events, int count)
+{
+	/* The device counter wraps, so times are accumulated from the
+	 * differences between consecutive events */
+	unsigned long long ts [TRACE_DUMP_MAX];
+	const char *sep = "\n";
+
+	if (count > TRACE_DUMP_MAX) {
+		count = TRACE_DUMP_MAX;
+	}
+
+	for (int i = 0; i < count; i++) {
+		ts[i] = i ? ts[i - 1] + (uint32_t) (events[i].time -
+				events[i - 1].time) : 0;
+	}
+
+	fputs("{\"traceEvents\": [", out);
+
+	for (int tid = TID_CAPTURE; tid <= TID_USB; tid++) {
+		fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+				"\"pid\": 1, \"tid\": %d, "
+				"\"args\": {\"name\": \"%s\"}}",
+				sep, tid, thread_names[tid]);
+		sep = ",\n";
+	}
+
+	for (int i = 0; i < count; i++) {
+		const struct trace_event *e = &events[i];
+		/* Completions are shown as the end of their submit event */
+		if (e->type == TRACE_USB_COMPLETE || e->type > TRACE_QUEUE) {
+			continue;
+		}
+
+		int end = find_end(events, count, i);
+
+		fputs(sep, out);
+
+		switch (e->type) {
+		case TRACE_UART:
+			fprintf(out, "{\"name\": \"uart input\", \"ph\": \"i\", "
+					"\"s\": \"t\", \"ts\": %llu, \"pid\": 1, "
+					"\"tid\": %d}", ts[i], TID_CAPTURE);
+			break;
+		case TRACE_CAPTURE_BEGIN:
+		case TRACE_CAPTURE_END:
+			fprintf(out, "{\"name\": \"capture %u\", \"ph\": \"%s\", "
+					"\"ts\": %llu, \"pid\": 1, \"tid\": %d}",
+					e->value, e->type == TRACE_CAPTURE_BEGIN ? "B" : "E",
+					ts[i], TID_CAPTURE);
+			break;
+		case TRACE_COMMAND:
+			fprintf(out, "{\"name\": \"%c%c\", \"ph\": \"X\", "
+					"\"ts\": %llu, \"dur\": %llu, \"pid\": 1, \"tid\": %d}",
+					e->value >> 8, e->value & 0xFF, ts[i],
+					end < 0 ? 0 : ts[end] - ts[i], TID_PARSER);
+			break;
+		case TRACE_USB_SUBMIT:
+			fprintf(out, "{\"name\": \"packet %u\", \"ph\": \"X\", "
+					"\"ts\": %llu, \"dur\": %llu, \"pid\": 1, \"tid\": %d}",
+					e->value, ts[i], end < 0 ? 0 : ts[end] - ts[i],
+					TID_USB);
+			break;
+		case TRACE_QUEUE:
+			fprintf(out, "{\"name\": \"queue depth\", \"ph\": \"C\", "
+					"\"ts\": %llu, \"pid\": 1, "
+					"\"args\": {\"depth\": %u}}", ts[i], e->value);
+			break;
+		}
+	}
+
+	fputs("\n]}\n", out);
+}
@@ -0,0 +1,44 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef TRACE_DUMP_H
+#define TRACE_DUMP_H
+
+#include "common.h"
+#include <stdio.h>
+
+#define TRACE_DUMP_MAX 256
+
+/* Collects the events of a trace dump from USB_PACKET_TRACE packets */
+struct trace_dump {
+	struct trace_event events [TRACE_DUMP_MAX];
+	int received;
+	int total;
+	int complete;
+};
+
+void trace_dump_init(struct trace_dump *dump);
+int trace_dump_packet(struct trace_dump *dump,
+		const struct usb_packet_trace *packet);
+
+/* Writes at most TRACE_DUMP_MAX events in the Chrome trace event format,
+ * which can be loaded into Perfetto or chrome://tracing. */
+void trace_write_json(FILE *out, const struct trace_event *events, int count);
+
+#endif /* TRACE_DUMP_H */
@@ -0,0 +1,627 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "dso.h"
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int usb_read(struct dso_transport *t, uint8_t *buf, size_t len,
+		unsigned timeout)
+{
+	struct dso_usb *usb = (struct dso_usb *) t;
+	int rlen;
+
+	/* 0 is kept for the end of a replay; the adapter sends no zero length
+	 * packets anyway */
+	do {
+		int r = libusb_bulk_transfer(usb->handle, 0x82, buf, len, &rlen,
+				timeout);
+
+		/* Data that arrived before a timeout is still returned */
+		if (r == LIBUSB_ERROR_TIMEOUT && rlen > 0) {
+			break;
+		}
+
+		if (r < 0) {
+			return r == LIBUSB_ERROR_TIMEOUT ? -DSO_ERROR_TIMEOUT :
+				-DSO_ERROR_USB;
+		}
+	} while (!rlen);
+
+	return rlen;
+}
+
+static int usb_request(struct dso_transport *t, uint8_t request,
+		uint16_t value)
+{
+	struct dso_usb *usb = (struct dso_usb *) t;
+
+	if (libusb_control_transfer(usb->handle,
+			LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR |
+			LIBUSB_RECIPIENT_INTERFACE,
+			request, value, 0, 0, 0, 1000) < 0) {
+		return -DSO_ERROR_REQUEST;
+	}
+
+	return 0;
+}
+
+static void usb_close(struct dso_transport *t)
+{
+	struct dso_usb *usb = (struct dso_usb *) t;
+
+	if (usb->claimed) {
+		libusb_release_interface(usb->handle, 0);
+		usb->claimed = 0;
+	}
+
+	if (usb->handle) {
+		libusb_close(usb->handle);
+		usb->handle = 0;
+	}
+
+	if (usb->context) {
+		libusb_exit(usb->context);
+		usb->context = 0;
+	}
+}
+
+/* Opens the first adapter found, in a libusb context of its own */
+int dso_usb_open(struct dso_usb *usb)
+{
+	int r;
+	ssize_t dev_cnt;
+	libusb_device **devs;
+
+	memset(usb, 0, sizeof(*usb));
+	usb->transport.read = usb_read;
+	usb->transport.request = usb_request;
+	usb->transport.close = usb_close;
+
+	r = libusb_init(&usb->context);
+
+	if (r < 0) {
+		usb->context = 0;
+		return -DSO_ERROR_USB;
+	}
+
+	r = dev_cnt = libusb_get_device_list(usb->context, &devs);
+	if (r < 0) {
+		r = -DSO_ERROR_USB;
+		goto exit;
+	}
+
+	for (int i = 0; i < dev_cnt; i++) {
+		struct libusb_device_descriptor desc;
+		libusb_device *dev = devs[i];
+
+		r = libusb_get_device_descriptor(dev, &desc);
+		if (r < 0) {
+			r = -DSO_ERROR_USB;
+			break;
+		}
+
+		if (desc.idVendor == 0x9876 && desc.idProduct == 0x4567) {
+			r = libusb_open(dev, &usb->handle);
+			if (r < 0) {
+				r = -DSO_ERROR_USB;
+				usb->handle = 0;
+			} else if (libusb_get_string_descriptor_ascii(usb->handle,
+						desc.iSerialNumber,
+						(unsigned char *) usb->transport.serial,
+						sizeof(usb->transport.serial)) < 0) {
+				usb->transport.serial[0] = 0;
+			}
+			break;
+		}
+	}
+
+	libusb_free_device_list(devs, 1);
+
+	if (r < 0) {
+		goto exit;
+	}
+
+	if (!usb->handle) {
+		r = -DSO_ERROR_NO_DEVICE;
+		goto exit;
+	}
+
+	r = libusb_claim_interface(usb->handle, 0);
+	if (r < 0) {
+		r = -DSO_ERROR_USB;
+		goto exit;
+	}
+	usb->claimed = 1;
+
+	return 0;
+exit:
+	usb_close(&usb->transport);
+	return r;
+}
+
+static int file_read(struct dso_transport *t, uint8_t *buf, size_t len,
+		unsigned timeout)
+{
+	struct dso_file *file = (struct dso_file *) t;
+	size_t n = fread(buf, 1, len, file->file);
+
+	(void) timeout;
+
+	if (!n && ferror(file->file)) {
+		return -DSO_ERROR_IO;
+	}
+
+	return n;
+}
+
+/* A recording has no device to take requests, so they are ignored */
+static int file_request(struct dso_transport *t, uint8_t request,
+		uint16_t value)
+{
+	(void) t;
+	(void) request;
+	(void) value;
+
+	return 0;
+}
+
+static void file_close(struct dso_transport *t)
+{
+	struct dso_file *file = (struct dso_file *) t;
+
+	if (file->file) {
+		fclose(file->file);
+		file->file = 0;
+	}
+}
+
+/* Replays a recording of the adapter's IN endpoint: the packets as sent,
+ * back to back */
+int dso_file_open(struct dso_file *file, const char *path)
+{
+	memset(file, 0, sizeof(*file));
+	file->transport.read = file_read;
+	file->transport.request = file_request;
+	file->transport.close = file_close;
+
+	if (!(file->file = fopen(path, "rb"))) {
+		return -DSO_ERROR_IO;
+	}
+
+	return 0;
+}
+
+/* Link types of usbmon captures, which differ in the size of the header
+ * before the data */
+#define LINKTYPE_USB_LINUX 189
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_BOM 0x1a2b3c4d
+
+enum {
+	PCAPNG_IDB = 1,
+	PCAPNG_SPB = 3,
+	PCAPNG_EPB = 6,
+};
+
+static uint16_t get16(const struct dso_pcap *p, const uint8_t *ptr)
+{
+	uint16_t v;
+
+	memcpy(&v, ptr, sizeof(v));
+
+	return p->swapped ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t get32(const struct dso_pcap *p, const uint8_t *ptr)
+{
+	uint32_t v;
+
+	memcpy(&v, ptr, sizeof(v));
+
+	return p->swapped ? __builtin_bswap32(v) : v;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Reads len bytes into the block buffer at offset. Returns 0 at the end of
+ * the file, before anything is read, 1 once read or a negative error. */
+static int read_block(struct dso_pcap *p, size_t offset, size_t len)
+{
+	if (offset + len > p->block_size) {
+		uint8_t *block = realloc(p->block, offset + len);
+
+		if (!block) {
+			return -DSO_ERROR_MEMORY;
+		}
+
+		p->block = block;
+		p->block_size = offset + len;
+	}
+
+	size_t n = fread(p->block + offset, 1, len, p->file);
+
+	if (n == len) {
+		return 1;
+	}
+
+	if (n == 0 && offset == 0 && !ferror(p->file)) {
+		return 0;
+	}
+
+	return ferror(p->file) ? -DSO_ERROR_IO : -DSO_ERROR_FORMAT;
+}
+
+static void add_interface(struct dso_pcap *p, uint16_t linktype,
+		uint64_t ts_units)
+{
+	if (p->interfaces < DSO_PCAP_INTERFACES) {
+		p->linktype[p->interfaces] = linktype;
+		p->ts_units[p->interfaces] = ts_units;
+		p->interfaces++;
+	}
+}
+
+/* Timestamp resolution of an interface from its if_tsresol option */
+static uint64_t pcapng_ts_units(const struct dso_pcap *p, const uint8_t *opt,
+		const uint8_t *end)
+{
+	while (opt + 4 <= end) {
+		uint16_t code = get16(p, opt);
+		uint16_t len = get16(p, opt + 2);
+
+		if (code == 0) {
+			break;
+		}
+
+		if (code == 9 && len == 1 && opt + 5 <= end) {
+			uint8_t res = opt[4];
+			uint64_t units = 1;
+
+			for (int i = 0; i < (res & 0x7f); i++) {
+				units *= res & 0x80 ? 2 : 10;
+			}
+
+			return units;
+		}
+
+		opt += 4 + ((len + 3) & ~3);
+	}
+
+	return 1000000;
+}
+
+/* Reads the next packet record of any interface. Returns 1 with its
+ * interface, time and data, 0 at the end of the file or a negative
+ * error. */
+static int next_record(struct dso_pcap *p, int *iface, double *ts,
+		const uint8_t **data, size_t *len)
+{
+	int r;
+
+	if (!p->pcapng) {
+		if ((r = read_block(p, 0, 16)) <= 0) {
+			return r;
+		}
+
+		uint32_t incl = get32(p, p->block + 8);
+
+		*iface = 0;
+		*ts = get32(p, p->block) + (double) get32(p, p->block + 4) /
+			p->ts_units[0];
+
+		if ((r = read_block(p, 16, incl)) <= 0) {
+			return r ? r : -DSO_ERROR_FORMAT;
+		}
+
+		*data = p->block + 16;
+		*len = incl;
+
+		return 1;
+	}
+
+	for (;;) {
+		if ((r = read_block(p, 0, 8)) <= 0) {
+			return r;
+		}
+
+		uint32_t type = get32(p, p->block);
+		uint32_t total = get32(p, p->block + 4);
+
+		/* A new section may change the byte order */
+		if (type == PCAPNG_SHB) {
+			if ((r = read_block(p, 8, 4)) <= 0) {
+				return r ? r : -DSO_ERROR_FORMAT;
+			}
+
+			p->swapped = *(uint32_t *) (p->block + 8) != PCAPNG_BOM;
+			p->interfaces = 0;
+			total = get32(p, p->block + 4);
+
+			if (total < 12 || (r = read_block(p, 12, total - 12)) <= 0) {
+				return r < 0 ? r : -DSO_ERROR_FORMAT;
+			}
+
+			continue;
+		}
+
+		if (total < 12 || (r = read_block(p, 8, total - 8)) <= 0) {
+			return r < 0 ? r : -DSO_ERROR_FORMAT;
+		}
+
+		const uint8_t *body = p->block + 8;
+		const uint8_t *end = p->block + total - 4;
+
+		switch (type) {
+		case PCAPNG_IDB:
+			if (end - body >= 8) {
+				add_interface(p, get16(p, body),
+						pcapng_ts_units(p, body + 8, end));
+			}
+			break;
+		case PCAPNG_EPB:
+			if (end - body < 20) {
+				break;
+			}
+
+			uint32_t id = get32(p, body);
+			uint64_t t = (uint64_t) get32(p, body + 4) << 32 |
+				get32(p, body + 8);
+			uint32_t cap = get32(p, body + 12);
+
+			if (id >= (uint32_t) p->interfaces || cap > end - body - 20) {
+				break;
+			}
+
+			*iface = id;
+			*ts = (double) t / p->ts_units[id];
+			*data = body + 20;
+			*len = cap;
+			return 1;
+		case PCAPNG_SPB:
+			if (end - body < 4 || p->interfaces == 0) {
+				break;
+			}
+
+			*iface = 0;
+			*ts = 0;
+			*data = body + 4;
+			*len = end - body - 4;
+			return 1;
+		}
+	}
+}
+
+/* Waits until the time of a transfer has come, relative to the first */
+static void pace(struct dso_pcap *p, double ts)
+{
+	if (!p->first_time) {
+		p->first_ts = ts;
+		p->first_time = now();
+		return;
+	}
+
+	double wait = p->first_time + (ts - p->first_ts) - now();
+
+	if (wait > 0) {
+		struct timespec t = {wait, (wait - (long) wait) * 1e9};
+
+		nanosleep(&t, 0);
+	}
+}
+
+/* Finds the next completed bulk IN transfer from endpoint 0x82. The
+ * usbmon header has the transfer type, endpoint, device and status at the
+ * same offsets for both link types, and the captured length at 36. */
+static int pcap_read(struct dso_transport *t, uint8_t *buf, size_t len,
+		unsigned timeout)
+{
+	struct dso_pcap *p = (struct dso_pcap *) t;
+
+	(void) timeout;
+
+	while (!p->len) {
+		const uint8_t *data;
+		size_t size;
+		double ts;
+		int iface;
+		int r = next_record(p, &iface, &ts, &data, &size);
+
+		if (r <= 0) {
+			return r;
+		}
+
+		size_t header = p->linktype[iface] == LINKTYPE_USB_LINUX ? 48 :
+			p->linktype[iface] == LINKTYPE_USB_LINUX_MMAPPED ? 64 : 0;
+
+		if (!header || size < header || data[8] != 'C' || data[9] != 3 ||
+				data[10] != 0x82 || get32(p, data + 28) != 0) {
+			continue;
+		}
+
+		if (!p->devnum) {
+			p->devnum = data[11];
+		} else if (data[11] != p->devnum) {
+			continue;
+		}
+
+		size_t cap = get32(p, data + 36);
+
+		p->data = data + header;
+		p->len = cap < size - header ? cap : size - header;
+
+		if (p->realtime && p->len) {
+			pace(p, ts);
+		}
+	}
+
+	size_t n = p->len < len ? p->len : len;
+
+	memcpy(buf, p->data, n);
+	p->data += n;
+	p->len -= n;
+
+	return n;
+}
+
+static void pcap_close(struct dso_transport *t)
+{
+	struct dso_pcap *p = (struct dso_pcap *) t;
+
+	if (p->file) {
+		fclose(p->file);
+		p->file = 0;
+	}
+
+	free(p->block);
+	p->block = 0;
+}
+
+static int read_magic(const char *path, uint32_t *magic)
+{
+	FILE *f = fopen(path, "rb");
+	int r = f && fread(magic, sizeof(*magic), 1, f) == 1 ? 0 : -1;
+
+	if (f) {
+		fclose(f);
+	}
+
+	return r;
+}
+
+int dso_pcap_is_capture(const char *path)
+{
+	uint32_t magic;
+
+	if (read_magic(path, &magic) < 0) {
+		return 0;
+	}
+
+	return magic == PCAPNG_SHB || magic == PCAP_MAGIC ||
+		magic == PCAP_MAGIC_NS || magic == __builtin_bswap32(PCAP_MAGIC) ||
+		magic == __builtin_bswap32(PCAP_MAGIC_NS);
+}
+
+int dso_pcap_open(struct dso_pcap *p, const char *path, int realtime)
+{
+	memset(p, 0, sizeof(*p));
+	p->transport.read = pcap_read;
+	p->transport.request = file_request;
+	p->transport.close = pcap_close;
+	p->realtime = realtime;
+
+	if (!(p->file = fopen(path, "rb"))) {
+		return -DSO_ERROR_IO;
+	}
+
+	int r;
+
+	if ((r = read_block(p, 0, 4)) <= 0) {
+		goto invalid;
+	}
+
+	uint32_t magic = *(uint32_t *) p->block;
+
+	if (magic == PCAPNG_SHB) {
+		/* Sections are handled as they come */
+		p->pcapng = 1;
+		rewind(p->file);
+		return 0;
+	}
+
+	p->swapped = magic == __builtin_bswap32(PCAP_MAGIC) ||
+		magic == __builtin_bswap32(PCAP_MAGIC_NS);
+
+	if (get32(p, p->block) != PCAP_MAGIC &&
+			get32(p, p->block) != PCAP_MAGIC_NS) {
+		r = 0;
+		goto invalid;
+	}
+
+	uint64_t units = get32(p, p->block) == PCAP_MAGIC ? 1000000 : 1000000000;
+
+	if ((r = read_block(p, 0, 20)) <= 0) {
+		goto invalid;
+	}
+
+	add_interface(p, get32(p, p->block + 16), units);
+
+	return 0;
+invalid:
+	pcap_close(&p->transport);
+	return r < 0 ? r : -DSO_ERROR_FORMAT;
+}
+
+static int mem_read(struct dso_transport *t, uint8_t *buf, size_t len,
+		unsigned timeout)
+{
+	struct dso_mem *mem = (struct dso_mem *) t;
+	size_t n = mem->len - mem->pos;
+
+	(void) timeout;
+
+	if (n > len) {
+		n = len;
+	}
+
+	memcpy(buf, mem->data + mem->pos, n);
+	mem->pos += n;
+
+	return n;
+}
+
+static int mem_request(struct dso_transport *t, uint8_t request,
+		uint16_t value)
+{
+	struct dso_mem *mem = (struct dso_mem *) t;
+
+	mem->request = request;
+	mem->value = value;
+
+	return 0;
+}
+
+static void mem_close(struct dso_transport *t)
+{
+	(void) t;
+}
+
+void dso_mem_init(struct dso_mem *mem, const void *data, size_t len)
+{
+	memset(mem, 0, sizeof(*mem));
+	mem->transport.read = mem_read;
+	mem->transport.request = mem_request;
+	mem->transport.close = mem_close;
+	mem->data = data;
+	mem->len = len;
+}
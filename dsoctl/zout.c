@@ -0,0 +1,295 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#define _GNU_SOURCE
+#include "zout.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ZOUT_OUT_SIZE (64 * 1024)
+
+/* Selects the format by name or by the suffix of a file name */
+int zout_format(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (strcmp(name, "gzip") == 0 ||
+			(len > 5 && strcmp(name + len - 5, ".svgz") == 0) ||
+			(len > 3 && strcmp(name + len - 3, ".gz") == 0)) {
+		return ZOUT_GZIP;
+	}
+
+	if (strcmp(name, "zstd") == 0 ||
+			(len > 4 && strcmp(name + len - 4, ".zst") == 0)) {
+#ifdef HAVE_ZSTD
+		return ZOUT_ZSTD;
+#else
+		fprintf(stderr, "dsoctl was built without zstd\n");
+		return -1;
+#endif
+	}
+
+	return ZOUT_NONE;
+}
+
+static void publish(struct zout *z, int end, int stop)
+{
+	struct zout_block *b = &z->blocks[z->head % ZOUT_BLOCKS];
+
+	b->end = end;
+	b->stop = stop;
+	z->head++;
+	sem_post(&z->ready);
+
+	if (!stop) {
+		sem_wait(&z->free);
+		z->blocks[z->head % ZOUT_BLOCKS].len = 0;
+	}
+}
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size)
+{
+	struct zout *z = cookie;
+	size_t left = size;
+
+	while (left) {
+		struct zout_block *b = &z->blocks[z->head % ZOUT_BLOCKS];
+		size_t n = ZOUT_BLOCK - b->len;
+
+		if (n > left) {
+			n = left;
+		}
+
+		memcpy(b->data + b->len, buf, n);
+		b->len += n;
+		buf += n;
+		left -= n;
+
+		if (b->len == ZOUT_BLOCK) {
+			publish(z, 0, 0);
+		}
+	}
+
+	return size;
+}
+
+static int write_out(struct zout *z, const void *data, size_t len)
+{
+	if (len && fwrite(data, 1, len, z->out) != len) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int gzip_block(struct zout *z, z_stream *zs, unsigned char *out,
+		const struct zout_block *b)
+{
+	int flush = b->end ? Z_FINISH : Z_NO_FLUSH;
+	int r;
+
+	zs->next_in = (unsigned char *) b->data;
+	zs->avail_in = b->len;
+
+	do {
+		zs->next_out = out;
+		zs->avail_out = ZOUT_OUT_SIZE;
+
+		if ((r = deflate(zs, flush)) == Z_STREAM_ERROR) {
+			return -1;
+		}
+
+		if (write_out(z, out, ZOUT_OUT_SIZE - zs->avail_out) < 0) {
+			return -1;
+		}
+	} while (zs->avail_out == 0 || (b->end && r != Z_STREAM_END));
+
+	return b->end ? deflateReset(zs) == Z_OK ? 0 : -1 : 0;
+}
+
+#ifdef HAVE_ZSTD
+static int zstd_block(struct zout *z, ZSTD_CCtx *cctx, unsigned char *out,
+		const struct zout_block *b)
+{
+	ZSTD_inBuffer in = {b->data, b->len, 0};
+	ZSTD_EndDirective mode = b->end ? ZSTD_e_end : ZSTD_e_continue;
+	size_t left;
+
+	do {
+		ZSTD_outBuffer o = {out, ZOUT_OUT_SIZE, 0};
+
+		left = ZSTD_compressStream2(cctx, &o, &in, mode);
+
+		if (ZSTD_isError(left) || write_out(z, out, o.pos) < 0) {
+			return -1;
+		}
+	} while (b->end ? left != 0 : in.pos < in.size);
+
+	return 0;
+}
+#endif
+
+static void *writer_main(void *arg)
+{
+	struct zout *z = arg;
+	unsigned char *out = malloc(ZOUT_OUT_SIZE);
+	z_stream zs = {0};
+	int open = 0;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx = z->format == ZOUT_ZSTD ? ZSTD_createCCtx() : 0;
+
+	if (z->format == ZOUT_ZSTD && !cctx) {
+		z->error = 1;
+	}
+#endif
+
+	/* A window of 15 bits with 16 added selects the gzip wrapper */
+	if (!out || (z->format == ZOUT_GZIP && deflateInit2(&zs,
+				Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK)) {
+		z->error = 1;
+	}
+
+	for (;;) {
+		sem_wait(&z->ready);
+
+		struct zout_block *b = &z->blocks[z->tail % ZOUT_BLOCKS];
+		int stop = b->stop;
+
+		open |= b->len != 0;
+
+		/* After an error the blocks are still taken, so that the
+		 * producer never waits for space. A capture end with nothing
+		 * written since the last needs no member of its own. */
+		if (!z->error && open) {
+			int r = 0;
+
+			if (z->format == ZOUT_GZIP) {
+				r = gzip_block(z, &zs, out, b);
+			}
+#ifdef HAVE_ZSTD
+			else {
+				r = zstd_block(z, cctx, out, b);
+			}
+#endif
+
+			if (r < 0 || (b->end && fflush(z->out))) {
+				z->error = 1;
+			}
+
+			open = !b->end;
+		}
+
+		z->tail++;
+		sem_post(&z->free);
+
+		if (stop) {
+			break;
+		}
+	}
+
+	if (z->format == ZOUT_GZIP) {
+		deflateEnd(&zs);
+	}
+
+#ifdef HAVE_ZSTD
+	ZSTD_freeCCtx(cctx);
+#endif
+	free(out);
+
+	return 0;
+}
+
+/* Without compression, in is out itself and no thread is started */
+int zout_open(struct zout *z, FILE *out, int format)
+{
+	cookie_io_functions_t io = {.write = cookie_write};
+
+	memset(z, 0, sizeof(*z));
+	z->out = out;
+	z->format = format;
+
+	if (format == ZOUT_NONE) {
+		z->in = out;
+		return 0;
+	}
+
+	if (!(z->blocks = malloc(ZOUT_BLOCKS * sizeof(*z->blocks)))) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	z->blocks[0].len = 0;
+	sem_init(&z->ready, 0, 0);
+	sem_init(&z->free, 0, ZOUT_BLOCKS - 1);
+
+	if (!(z->in = fopencookie(z, "w", io))) {
+		perror("fopencookie");
+		free(z->blocks);
+		return -1;
+	}
+
+	if (pthread_create(&z->thread, 0, writer_main, z)) {
+		fprintf(stderr, "Failed to start the writer thread\n");
+		fclose(z->in);
+		free(z->blocks);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Ends the gzip member or zstd frame, so that the capture can be read as
+ * soon as it has been written */
+void zout_capture_end(struct zout *z)
+{
+	if (z->format == ZOUT_NONE) {
+		fflush(z->in);
+		return;
+	}
+
+	fflush(z->in);
+	publish(z, 1, 0);
+}
+
+int zout_close(struct zout *z)
+{
+	if (z->format == ZOUT_NONE) {
+		return fflush(z->in) ? -1 : 0;
+	}
+
+	/* Anything after the last capture ends a member of its own */
+	fclose(z->in);
+	publish(z, 1, 1);
+	pthread_join(z->thread, 0);
+
+	sem_destroy(&z->ready);
+	sem_destroy(&z->free);
+	free(z->blocks);
+
+	if (fflush(z->out)) {
+		z->error = 1;
+	}
+
+	return z->error ? -1 : 0;
+}
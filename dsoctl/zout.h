@@ -0,0 +1,71 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef ZOUT_H
+#define ZOUT_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/* Compressed output. What is written to in is compressed on a writer thread
+ * of its own, so compression and disk I/O never hold up reception. Each
+ * capture becomes a gzip member or a zstd frame of its own; concatenated,
+ * they decompress to the captures' SVG one after the other.
+ *
+ * Data is handed to the writer in a ring of blocks. Each side only moves its
+ * own index and the semaphores count the blocks ready and free, so neither
+ * side takes a lock. */
+#define ZOUT_BLOCK (16 * 1024)
+#define ZOUT_BLOCKS 64
+
+enum {
+	ZOUT_NONE,
+	ZOUT_GZIP,
+	ZOUT_ZSTD,
+};
+
+struct zout_block {
+	size_t len;
+	int end;  /* ends a capture */
+	int stop; /* last block */
+	char data [ZOUT_BLOCK];
+};
+
+struct zout {
+	FILE *in;
+	FILE *out;
+	int format;
+
+	struct zout_block *blocks;
+	size_t head; /* block being filled, moved by the producer */
+	size_t tail; /* next block to compress, moved by the writer */
+	sem_t ready;
+	sem_t free;
+	pthread_t thread;
+	int error;
+};
+
+int zout_format(const char *name);
+int zout_open(struct zout *z, FILE *out, int format);
+void zout_capture_end(struct zout *z);
+int zout_close(struct zout *z);
+
+#endif /* ZOUT_H */
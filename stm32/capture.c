@@ -0,0 +1,346 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "capture.h"
+#include "generator.h"
+#include "hpgl.h"
+#include "store.h"
+#include "trace.h"
+#include "uart.h"
+#include "usb.h"
+#include "common.h"
+#include <stm32f0xx.h>
+
+/* The receive interrupt lexes the HPGL stream and queues the tokens for
+ * capture_loop(), or in MODE_RAW queues the received bytes unmodified.
+ *
+ * The last slot in the queue is reserved for TOKEN_RESYNC, or
+ * TOKEN_RAW_RESYNC in MODE_RAW. When the queue fills, input is dropped up
+ * to the next terminator, which is replaced by the resync token. */
+enum {
+	TOKEN_RAW = TOKEN_RESYNC + 1,
+	TOKEN_RAW_RESYNC,
+};
+
+#define QUEUE_LEN 128
+
+static volatile uint8_t queue_type [QUEUE_LEN];
+static volatile int16_t queue_value [QUEUE_LEN];
+static volatile uint8_t queue_head = 0;
+static volatile uint8_t queue_tail = 0;
+
+/* Input after this long without a byte is traced as the start of a capture */
+#define IDLE_TIME 50000
+
+static uint8_t discard = 0;
+static uint8_t raw_dropped = 0;
+static uint8_t raw_partial = 0;
+static uint8_t receiving_raw = 0;
+static volatile uint8_t queue_high = 0;
+static volatile uint32_t last_received = 0;
+static volatile uint16_t mode = MODE_CONVERT;
+
+static struct hpgl hpgl;
+
+static uint16_t capture_id = 0;
+static uint32_t capture_bytes = 0;
+static uint8_t in_capture = 0;
+
+/* Whether the capture in progress goes to the flash store rather than USB */
+static uint8_t storing = 0;
+
+static void push(struct hpgl *h, uint8_t type, int16_t value)
+{
+	(void) h;
+
+	uint8_t next = (queue_head + 1) % QUEUE_LEN;
+
+	/* TOKEN_RESYNC waits for a free slot if the one reserved for it has
+	 * already been taken by an earlier resync, rather than moving the head
+	 * onto the tail */
+	if (discard) {
+		if (type == TOKEN_END && next != queue_tail) {
+			discard = 0;
+			queue_type[queue_head] = TOKEN_RESYNC;
+			queue_head = next;
+		}
+
+		return;
+	}
+
+	/* The queue is also full when TOKEN_RESYNC has just taken the reserved
+	 * slot */
+	if (next == queue_tail || (next + 1) % QUEUE_LEN == queue_tail) {
+		discard = 1;
+		return;
+	}
+
+	queue_type[queue_head] = type;
+	queue_value[queue_head] = value;
+	queue_head = next;
+
+	uint8_t depth = (queue_head + QUEUE_LEN - queue_tail) % QUEUE_LEN;
+
+	if (depth > queue_high) {
+		queue_high = depth;
+		trace(TRACE_QUEUE, depth);
+	}
+}
+
+static void emit(struct hpgl *h, const void *data, uint8_t len)
+{
+	(void) h;
+
+	capture_bytes += len;
+
+	if (storing) {
+		store_write(data, len);
+	} else {
+		usb_log_data(USB_PACKET_LOG, data, len);
+	}
+}
+
+static void boundary(struct hpgl *h, int begin)
+{
+	(void) h;
+
+	if (begin) {
+		struct usb_packet_capture_begin packet = {
+			.id = ++capture_id,
+		};
+
+		capture_bytes = 0;
+		queue_high = 0;
+		in_capture = 1;
+		storing = store_enabled();
+		trace(TRACE_CAPTURE_BEGIN, capture_id);
+
+		if (storing) {
+			store_begin(capture_id);
+			return;
+		}
+
+		usb_log_packet(USB_PACKET_CAPTURE_BEGIN,
+				(uint8_t *) &packet + USB_PACKET_HEADER,
+				sizeof(packet) - USB_PACKET_HEADER);
+	} else {
+		struct usb_packet_capture_end packet = {
+			.id = capture_id,
+			.bytes = capture_bytes,
+		};
+
+		in_capture = 0;
+		trace(TRACE_CAPTURE_END, capture_id);
+
+		if (storing) {
+			store_end();
+			return;
+		}
+
+		usb_log_packet(USB_PACKET_CAPTURE_END,
+				(uint8_t *) &packet + USB_PACKET_HEADER,
+				sizeof(packet) - USB_PACKET_HEADER);
+	}
+}
+
+void capture_init()
+{
+	hpgl_init(&hpgl, push, emit, 0);
+	hpgl.boundary = boundary;
+}
+
+/* Queues TOKEN_RAW_RESYNC in the reserved slot. Returns 0, queueing nothing,
+ * when an earlier resync has taken that slot and the consumer has yet to free
+ * one. */
+static int raw_resync()
+{
+	if ((queue_head + 1) % QUEUE_LEN == queue_tail) {
+		return 0;
+	}
+
+	queue_type[queue_head] = TOKEN_RAW_RESYNC;
+	queue_value[queue_head] = raw_dropped;
+	queue_head = (queue_head + 1) % QUEUE_LEN;
+	raw_dropped = 0;
+	raw_partial = 0;
+	return 1;
+}
+
+static void receive_raw(char c)
+{
+	uint8_t next = (queue_head + 1) % QUEUE_LEN;
+	int terminator = c == ';' || c == 0x03;
+
+	if (raw_dropped) {
+		if (raw_dropped < 255) {
+			raw_dropped++;
+		}
+
+		if (terminator) {
+			raw_resync();
+		}
+
+		return;
+	}
+
+	if (next == queue_tail || (next + 1) % QUEUE_LEN == queue_tail) {
+		raw_dropped = 1;
+		return;
+	}
+
+	queue_type[queue_head] = TOKEN_RAW;
+	queue_value[queue_head] = (uint8_t) c;
+	queue_head = next;
+	raw_partial = !terminator;
+}
+
+/* A command cut short by a change of mode is ended before the input of the
+ * new mode, so that it is not joined to the commands that follow. While there
+ * is no slot for that resync, input stays raw and is dropped, and the switch
+ * is tried again with the next byte. */
+static void switch_input(uint8_t raw)
+{
+	if (raw) {
+		hpgl_lex_reset(&hpgl);
+	} else if ((raw_dropped || raw_partial) && !raw_resync()) {
+		return;
+	}
+
+	receiving_raw = raw;
+}
+
+static void receive(char c)
+{
+	uint32_t now = trace_time();
+
+	if (now - last_received > IDLE_TIME) {
+		trace(TRACE_UART, 0);
+	}
+
+	last_received = now;
+
+	/* Captures are always stored as drawing operations */
+	uint8_t raw = mode == MODE_RAW && !store_enabled();
+
+	if (raw != receiving_raw) {
+		switch_input(raw);
+	}
+
+	if (receiving_raw) {
+		receive_raw(c);
+		return;
+	}
+
+	hpgl_lex(&hpgl, c);
+}
+
+void capture_received(char c)
+{
+	if (!generator_active()) {
+		receive(c);
+	}
+}
+
+/* Input from the generator replaces the UART while it runs, and is only fed
+ * while the queue has room for the tokens of a byte, so none is dropped. */
+static void generate()
+{
+	int c;
+
+	while ((queue_tail + QUEUE_LEN - queue_head - 1) % QUEUE_LEN > 4 &&
+			(c = generator_next()) >= 0) {
+		receive(c);
+	}
+}
+
+void capture_set_mode(uint16_t new_mode)
+{
+	mode = new_mode;
+}
+
+static void send_raw(uint8_t head)
+{
+	uint8_t data [sizeof(((struct usb_packet_log *) 0)->payload)];
+	uint8_t len = 0;
+
+	while (queue_tail != head && queue_type[queue_tail] == TOKEN_RAW &&
+			len < sizeof(data)) {
+		data[len++] = queue_value[queue_tail];
+		queue_tail = (queue_tail + 1) % QUEUE_LEN;
+	}
+
+	usb_log_data(USB_PACKET_RAW, data, len);
+}
+
+/* The flash store may only stall the CPU between captures, and while no
+ * input is arriving from the UART */
+static int idle()
+{
+	return !in_capture && (generator_active() ||
+			trace_time() - last_received > IDLE_TIME);
+}
+
+void capture_loop()
+{
+	while (1) {
+		trace_poll();
+		store_poll(idle(), queue_tail == queue_head);
+		generate();
+
+		__disable_irq();
+
+		if (queue_tail == queue_head) {
+			__WFI();
+			__enable_irq();
+			continue;
+		}
+
+		__enable_irq();
+
+		uint8_t head = queue_head;
+
+		while (queue_tail != head) {
+			uint8_t type = queue_type[queue_tail];
+
+			if (type == TOKEN_RAW) {
+				send_raw(head);
+				continue;
+			}
+
+			if (type == TOKEN_RAW_RESYNC) {
+				uint8_t dropped = queue_value[queue_tail];
+
+				uart_send_str("resync\n");
+				usb_log_packet(USB_PACKET_RAW_RESYNC, &dropped, 1);
+				queue_tail = (queue_tail + 1) % QUEUE_LEN;
+				continue;
+			}
+
+			if (type == TOKEN_RESYNC) {
+				uart_send_str("resync\n");
+			} else if (type == TOKEN_COMMAND) {
+				trace(TRACE_COMMAND, queue_value[queue_tail]);
+			}
+
+			hpgl_token(&hpgl, type, queue_value[queue_tail]);
+			queue_tail = (queue_tail + 1) % QUEUE_LEN;
+			store_poll(idle(), queue_tail == queue_head);
+		}
+	}
+}
@@ -0,0 +1,58 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "flash.h"
+#include <stm32f0xx.h>
+
+static void unlock()
+{
+	if (FLASH->CR & FLASH_CR_LOCK) {
+		FLASH->KEYR = FLASH_KEY1;
+		FLASH->KEYR = FLASH_KEY2;
+	}
+}
+
+static void wait()
+{
+	while (FLASH->SR & FLASH_SR_BSY) {
+	}
+
+	FLASH->SR = FLASH_SR_EOP;
+}
+
+void flash_erase(const void *page)
+{
+	unlock();
+	FLASH->CR |= FLASH_CR_PER;
+	FLASH->AR = (uint32_t) page;
+	FLASH->CR |= FLASH_CR_STRT;
+	wait();
+	FLASH->CR &= ~FLASH_CR_PER;
+	FLASH->CR |= FLASH_CR_LOCK;
+}
+
+void flash_program(const void *addr, uint16_t value)
+{
+	unlock();
+	FLASH->CR |= FLASH_CR_PG;
+	*(volatile uint16_t *) addr = value;
+	wait();
+	FLASH->CR &= ~FLASH_CR_PG;
+	FLASH->CR |= FLASH_CR_LOCK;
+}
@@ -0,0 +1,33 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stdint.h>
+
+/* Programming of the STM32F042's own flash, in 1 KB pages of half-words.
+ * The CPU stalls on any flash access while a page is being erased, for up
+ * to 40 ms, and while a half-word is being programmed, for about 50 us. */
+#define FLASH_PAGE 1024
+
+void flash_erase(const void *page);
+void flash_program(const void *addr, uint16_t value);
+
+#endif /* FLASH_H */
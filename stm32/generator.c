@@ -0,0 +1,201 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "generator.h"
+#include "trace.h"
+
+/* Synthetic plots for load testing, in the same form as the oscilloscope's
+ * output: a frame, two labels and a dense trace on each channel. Each plot
+ * is produced a command or a point at a time into a small buffer.
+ *
+ * Coordinates are plotter units as the oscilloscope sends them. The frame
+ * is the graticule, 10 by 8 divisions of 50 by 30 units from (0, 8) to
+ * (500, 248) with its centre line at y 128, and the labels are above it.
+ * Channel 1 runs about two divisions above the centre and channel 2 about
+ * two below.
+ *
+ * rate limits the output to that many bytes per millisecond, 0 produces
+ * bytes as fast as they are consumed. */
+#define POINTS 500
+
+enum {
+	STEP_HEADER,
+	STEP_CH1 = STEP_HEADER + 1,
+	STEP_CH2 = STEP_CH1 + POINTS + 1,
+	STEP_END = STEP_CH2 + POINTS + 1,
+};
+
+/* One period of a sine approximation as y deltas, which sum to zero */
+static const int8_t sine [] = {
+	2, 4, 5, 6, 6, 5, 4, 2, 0, -2, -4, -5, -6, -6, -5, -4, -2, 0, 0, 0
+};
+
+static const char *header = "IN;SP1;PU0,8;PD500,8,500,248,0,248,0,8;"
+	"SP2;PU10,260;LBCH1 1V/DIV\3SP3;PU260,260;LB100us/DIV\3";
+
+static struct {
+	uint8_t captures;
+	uint8_t rate;
+	volatile uint8_t stop;
+	uint16_t step;
+	uint16_t phase;
+	const char *str;
+	char buf [24];
+	uint8_t len;
+	uint8_t pos;
+	uint32_t start;
+	uint32_t sent;
+} gen;
+
+void generator_start(uint8_t captures, uint8_t rate)
+{
+	gen.captures = captures;
+	gen.rate = rate;
+	gen.stop = 0;
+	gen.step = STEP_HEADER;
+	gen.str = 0;
+	gen.len = 0;
+	gen.pos = 0;
+	gen.start = trace_time();
+	gen.sent = 0;
+}
+
+/* Called from the USB interrupt, the plot in progress is finished by
+ * generator_next(), so that it is not left open for the UART input that
+ * follows */
+void generator_stop()
+{
+	gen.stop = 1;
+}
+
+int generator_active()
+{
+	return gen.captures || gen.str || gen.pos != gen.len;
+}
+
+static void append(const char *s)
+{
+	while (*s) {
+		gen.buf[gen.len++] = *s++;
+	}
+}
+
+static void append_int(int n)
+{
+	char digits [6];
+	int i = 0;
+
+	if (n < 0) {
+		gen.buf[gen.len++] = '-';
+		n = -n;
+	}
+
+	do {
+		digits[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+
+	while (i) {
+		gen.buf[gen.len++] = digits[--i];
+	}
+}
+
+static int dy(int channel, int i)
+{
+	i += gen.phase;
+
+	if (channel == 1) {
+		return sine[i % sizeof(sine)];
+	}
+
+	/* Square wave with one pixel of ripple */
+	switch (i % 50) {
+	case 0:
+		return 40;
+	case 25:
+		return -40;
+	default:
+		return i & 1 ? 1 : -1;
+	}
+}
+
+/* Fills the buffer with the text of the next step of the plot */
+static void next_step()
+{
+	uint16_t step = gen.step++;
+
+	gen.len = 0;
+	gen.pos = 0;
+	gen.str = 0;
+
+	if (step == STEP_HEADER) {
+		gen.str = header;
+	} else if (step == STEP_CH1) {
+		append("SP2;LT;PU0,170;PD;PR");
+	} else if (step == STEP_CH2) {
+		append(";PU;SP3;PU0,60;PD;PR");
+	} else if (step < STEP_END) {
+		int channel = step < STEP_CH2 ? 1 : 2;
+
+		append("1,");
+		append_int(dy(channel, step - (channel == 1 ? STEP_CH1 : STEP_CH2)));
+		append(",");
+	} else {
+		append(";PU;SP0;");
+		gen.step = STEP_HEADER;
+		gen.phase++;
+		gen.captures--;
+	}
+}
+
+/* Returns the next byte of the plots, or -1 when none is due */
+int generator_next()
+{
+	if (gen.stop) {
+		gen.stop = 0;
+
+		if (gen.step == STEP_HEADER) {
+			gen.captures = 0;
+		} else {
+			gen.step = STEP_END;
+			gen.captures = 1;
+		}
+	}
+
+	if (!generator_active()) {
+		return -1;
+	}
+
+	if (gen.rate && gen.sent >= (trace_time() - gen.start) / 1000 * gen.rate) {
+		return -1;
+	}
+
+	if (gen.str && !*gen.str) {
+		gen.str = 0;
+		gen.pos = gen.len = 0;
+	}
+
+	if (!gen.str && gen.pos == gen.len) {
+		next_step();
+	}
+
+	gen.sent++;
+
+	return gen.str ? *gen.str++ : gen.buf[gen.pos++];
+}
@@ -18,382 +18,478 @@
  */
 
 #include "hpgl.h"
-#include "usb.h"
-#include <stdlib.h>
-#include <string.h>
-#include <stm32f0xx.h>
-#include "uart.h"
-
-static const char *header = "\
-<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n\
-<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" \"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n\
-<svg width=\"700\" height=\"578\" viewBox=\"-10 -10 700 578\" xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\">\n";
-
-static const char *graticule = "\
-<defs>\n\
-<pattern id=\"grid\" width=\"50\" height=\"60\" y=\"64\" patternUnits=\"userSpaceOnUse\">\n\
-<path d=\"M 50 0 L 0 0 0 60\" fill=\"none\" stroke=\"black\" stroke-width=\"0.2\"/>\n\
-</pattern>\n\
-<pattern id=\"xaxis\" width=\"10\" height=\"8\" patternUnits=\"userSpaceOnUse\">\n\
-<path d=\"M 0 0 L 0 8\" fill=\"none\" stroke=\"black\" stroke-width=\"0.2\"/>\n\
-</pattern>\n\
-<pattern id=\"yaxis\" width=\"8\" height=\"12\" y=\"64\" patternUnits=\"userSpaceOnUse\">\n\
-<path d=\"M 0 0 L 8 0\" fill=\"none\" stroke=\"black\" stroke-width=\"0.2\"/>\n\
-</pattern>\n\
-</defs>\n\
-<rect width=\"500\" height=\"480\" y=\"64\" fill=\"none\" stroke=\"black\" stroke-width=\"0.2\" />\n\
-<rect width=\"500\" height=\"480\" y=\"64\" fill=\"url(#grid)\" />\n\
-<rect y=\"300\" width=\"500\" height=\"8\" fill=\"url(#xaxis)\" />\n\
-<rect x=\"246\" y=\"64\" width=\"8\" height=\"480\" fill=\"url(#yaxis)\" />\n";
-
-static char buf [128], *buf_ptr = buf;
-
-static int pen = 0;
-static int pen_down = 0;
-static int line_type = 0;
-static int x = 0;
-static int y = 256;
-static int xy_state = 0;
-
-static void sp()
+#include "common.h"
+#include <stddef.h>
+
+static void op(struct hpgl *h, uint8_t code)
 {
-	if (buf_ptr - buf <= 1 || (buf_ptr[-1] != ',' && buf_ptr[-1] != ';')) {
-		return;
-	}
+	h->emit(h, &code, 1);
+}
 
-	int new_pen = *buf - '0';
+static void op_arg(struct hpgl *h, uint8_t code, uint8_t arg)
+{
+	uint8_t data [] = {code, arg};
 
-	if (pen == 0 && new_pen != 0) {
-		usb_log_str(header);
-		usb_log_str(graticule);
-	} else if (pen != 0 && new_pen == 0) {
-		usb_log_str("</svg>\n");
-	}
+	h->emit(h, data, sizeof(data));
+}
 
-	pen = new_pen;
+static void op_xy(struct hpgl *h, uint8_t code, int x, int y)
+{
+	uint8_t data [] = {code, x, x >> 8, y, y >> 8};
 
-	buf_ptr = buf;
+	h->emit(h, data, sizeof(data));
 }
 
-static void color()
+static void sp(struct hpgl *h, int n)
 {
-	switch (pen) {
-	case 2:
-		usb_log_str("green");
-		break;
-	case 3:
-		usb_log_str("blue");
-		break;
-	default:
-		usb_log_str("black");
+	if (n == h->pen) {
+		return;
 	}
-}
 
+	if (h->pen == 0) {
+		if (h->boundary) {
+			h->boundary(h, 1);
+		}
 
-static void line_start()
-{
-	usb_log_str("<polyline stroke=\"");
-
-	color();
+		/* Each capture starts from the default line type on both sides, as
+		 * the host resets its line type at OP_BEGIN. Otherwise a type sent
+		 * in an earlier capture would not be sent again, and the host
+		 * would draw later captures with the wrong dash style. */
+		h->sent_line_type = 0;
+		op(h, OP_BEGIN);
+	}
 
-	usb_log_str("\" ");
+	if (n == 0) {
+		op(h, OP_END);
 
-	switch (line_type) {
-	case 2:
-		usb_log_str("stroke-dasharray=\"10 10\" ");
-		break;
+		if (h->boundary) {
+			h->boundary(h, 0);
+		}
+	} else {
+		op_arg(h, OP_PEN, n);
 	}
 
-	usb_log_str("points=\"");
+	h->pen = n;
 }
 
-static void line_end()
+static void line_type_update(struct hpgl *h)
 {
-	usb_log_str("\" stroke-width=\"1\" fill=\"none\" />\n");
+	if (h->line_type != h->sent_line_type) {
+		op_arg(h, OP_LINE_TYPE, h->line_type);
+		h->sent_line_type = h->line_type;
+	}
 }
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define CLAMP(x, a, b) (MIN(MAX(x, a), b))
-#define Y(y) CLAMP((560 - (y) * 2), 0, 560)
-
-static void pr_start()
+/* Points of a PR trace are collected into an OP_RUN while the x step stays
+ * the same and each y step fits in a nibble. */
+static void run_flush(struct hpgl *h)
 {
-	if (!pen_down) {
+	struct hpgl_run *run = &h->run;
+
+	if (!run->active) {
 		return;
 	}
 
-	line_start();
+	run->active = 0;
 
-	buf_ptr = buf;
+	if (run->count == 0) {
+		op_xy(h, OP_POINT, run->x, run->y);
+		return;
+	}
+
+	run->op[0] = OP_RUN;
+	run->op[1] = run->x;
+	run->op[2] = run->x >> 8;
+	run->op[3] = run->y;
+	run->op[4] = run->y >> 8;
+	run->op[5] = run->dx;
+	run->op[6] = run->count;
+
+	h->emit(h, run->op, OP_RUN_HEADER + (run->count + 1) / 2);
 }
 
-static void pr()
+static void run_point(struct hpgl *h, int x, int y)
 {
-	if (buf_ptr - buf <= 1 || (buf_ptr[-1] != ',' && buf_ptr[-1] != ';')) {
-		return;
-	}
+	struct hpgl_run *run = &h->run;
 
-	buf_ptr[-1] = 0;
-	buf_ptr = buf;
+	if (run->active) {
+		int dx = x - run->last_x;
+		int dy = y - run->last_y;
 
-	int n = atoi(buf);
+		if (run->count < OP_RUN_MAX && dy >= -8 && dy <= 7 &&
+				(run->count ? dx == run->dx : dx >= -128 && dx <= 127)) {
+			uint8_t *packed = run->op + OP_RUN_HEADER + run->count / 2;
 
-	xy_state ^= 1;
+			if (run->count & 1) {
+				*packed |= (dy & 0xF) << 4;
+			} else {
+				*packed = dy & 0xF;
+			}
 
-	if (xy_state == 1) {
-		x += n;
-		return;
+			run->dx = dx;
+			run->count++;
+			run->last_x = x;
+			run->last_y = y;
+			return;
+		}
+
+		run_flush(h);
 	}
 
-	y += n;
-	usb_log_int(x);
-	usb_log_str(",");
-	usb_log_int(Y(y));
-	usb_log_str(" ");
+	run->active = 1;
+	run->count = 0;
+	run->x = run->last_x = x;
+	run->y = run->last_y = y;
 }
 
-static void pr_end()
+static void pr_start(struct hpgl *h)
 {
-	if (!pen_down) {
+	if (!h->pen_down) {
 		return;
 	}
 
-	line_end();
+	line_type_update(h);
+	op(h, OP_POLYLINE);
 }
 
-static void pa()
+static void pr(struct hpgl *h, int n)
 {
-	if (!pen_down) {
-		return;
-	}
+	h->xy_state ^= 1;
 
-	if (buf_ptr - buf <= 1 || (buf_ptr[-1] != ',' && buf_ptr[-1] != ';')) {
+	if (h->xy_state == 1) {
+		h->x += n;
 		return;
 	}
 
-	buf_ptr[-1] = 0;
-	buf_ptr = buf;
+	h->y += n;
 
-	int n = atoi(buf);
-
-	xy_state ^= 1;
-
-	if (xy_state == 1) {
-		x = n;
-		return;
+	/* With the pen up a PR only moves it, and draws nothing */
+	if (h->pen_down) {
+		run_point(h, h->x, h->y);
 	}
-
-	y = n;
-
-	usb_log_str("<circle cx=\"");
-	usb_log_int(x);
-	usb_log_str("\" cy=\"");
-	usb_log_int(Y(y));
-	usb_log_str("\" r=\"1\" fill=\"black\" />\n");
 }
 
-static void pd_start()
+static void pr_end(struct hpgl *h)
 {
-	pen_down = 1;
+	run_flush(h);
 
-	buf_ptr = buf;
+	if (!h->pen_down) {
+		return;
+	}
+
+	op(h, OP_POLYLINE_END);
 }
 
-static void pd()
+static void pa(struct hpgl *h, int n)
 {
-	if (!pen_down) {
+	if (!h->pen_down) {
 		return;
 	}
 
-	if (buf_ptr - buf <= 1 || (buf_ptr[-1] != ',' && buf_ptr[-1] != ';')) {
+	h->xy_state ^= 1;
+
+	if (h->xy_state == 1) {
+		h->x = n;
 		return;
 	}
 
-	buf_ptr[-1] = 0;
-	buf_ptr = buf;
-
-	int n = atoi(buf);
-
-	xy_state ^= 1;
-
-	static int old_x, old_y;
+	h->y = n;
+	op_xy(h, OP_MARKER, h->x, h->y);
+}
 
-	if (xy_state) {
-		old_x = x;
-		x = n;
-	} else {
-		old_y = y;
-		y = n;
-
-		line_start();
-		usb_log_int(old_x);
-		usb_log_str(",");
-		usb_log_int(Y(old_y));
-		usb_log_str(" ");
-		usb_log_int(x);
-		usb_log_str(",");
-		usb_log_int(Y(y));
-		line_end();
-	}
+static void pd_start(struct hpgl *h)
+{
+	h->pen_down = 1;
 }
 
-static void pu()
+static void pd(struct hpgl *h, int n)
 {
-	if (buf_ptr - buf <= 1 || (buf_ptr[-1] != ',' && buf_ptr[-1] != ';')) {
+	if (!h->pen_down) {
 		return;
 	}
 
-	buf_ptr[-1] = 0;
-	buf_ptr = buf;
+	h->xy_state ^= 1;
+
+	if (h->xy_state) {
+		h->old_x = h->x;
+		h->x = n;
+	} else {
+		h->old_y = h->y;
+		h->y = n;
 
-	int n = atoi(buf);
+		uint8_t data [] = {
+			OP_LINE,
+			h->old_x, h->old_x >> 8, h->old_y, h->old_y >> 8,
+			h->x, h->x >> 8, h->y, h->y >> 8
+		};
 
-	xy_state ^= 1;
+		line_type_update(h);
+		h->emit(h, data, sizeof(data));
+	}
+}
+
+static void pu(struct hpgl *h, int n)
+{
+	h->xy_state ^= 1;
 
-	if (xy_state) {
-		x = n;
+	if (h->xy_state) {
+		h->x = n;
 	} else {
-		y = n;
+		h->y = n;
 	}
 
-	pen_down = 0;
+	h->pen_down = 0;
 }
 
-static void lb()
+static void lb(struct hpgl *h, int c)
 {
-	if (buf_ptr[-1] == 0x03) {
-		return;
+	if ((uint8_t) c >= OP_TEXT) {
+		op(h, c);
 	}
+}
 
-	char str [] = {buf_ptr[-1], 0};
-	usb_log_str(str);
-
-	buf_ptr = buf;
+static void lb_start(struct hpgl *h)
+{
+	op_xy(h, OP_LABEL, h->x, h->y);
 }
 
-static void lb_start()
+static void lb_end(struct hpgl *h)
 {
-	usb_log_str("<text x=\"");
-	usb_log_int(x + 3);
-	usb_log_str("\" y=\"");
-	usb_log_int(Y(y) + 5);
-	usb_log_str("\" font-family=\"mono\" font-size=\"14\" fill=\"");
-	color();
-	usb_log_str("\">");
+	op(h, OP_LABEL_END);
 }
 
-static void lb_end()
+static void lt_start(struct hpgl *h)
 {
-	usb_log_str("</text>\n");
+	h->line_type = 0;
 }
 
-static void lt()
+static void lt(struct hpgl *h, int n)
 {
-	if (buf_ptr - buf <= 1 || buf_ptr[-1] != ';') {
-		line_type = 0;
-		return;
-	}
+	h->xy_state ^= 1;
 
-	line_type = atoi(buf);
+	if (h->xy_state) {
+		h->line_type = n;
+	}
 }
 
-static struct cmd {
-	const char *str;
-	void (*func)();
-	void (*start)();
-	void (*end)();
+#define MNEMONIC(a, b) (((a) << 8) | (b))
+
+static const struct hpgl_cmd {
+	uint16_t mnemonic;
+	void (*func)(struct hpgl *h, int n);
+	void (*start)(struct hpgl *h);
+	void (*end)(struct hpgl *h);
 } cmds [] = {
-	{"SP", sp, 0, 0},
-	{"PR", pr, pr_start, pr_end},
-	{"PA", pa, 0, 0},
-	{"PD", pd, pd_start, 0},
-	{"PU", pu, 0, 0},
-	{"LB", lb, lb_start, lb_end},
-	{"LT", lt, 0, 0}
+	{MNEMONIC('S', 'P'), sp, 0, 0},
+	{MNEMONIC('P', 'R'), pr, pr_start, pr_end},
+	{MNEMONIC('P', 'A'), pa, 0, 0},
+	{MNEMONIC('P', 'D'), pd, pd_start, 0},
+	{MNEMONIC('P', 'U'), pu, 0, 0},
+	{MNEMONIC('L', 'B'), lb, lb_start, lb_end},
+	{MNEMONIC('L', 'T'), lt, lt_start, 0}
 };
 
-static struct cmd *cmd = 0;
+void hpgl_init(struct hpgl *h, hpgl_push_func push, hpgl_emit_func emit,
+		void *ctx)
+{
+	*h = (struct hpgl) {0};
+	h->y = 256;
+	h->push = push;
+	h->emit = emit;
+	h->ctx = ctx;
+}
 
-static volatile int overflow = 0;
+enum {
+	LEX_COMMAND,
+	LEX_PARAMS,
+	LEX_LABEL,
+};
 
-static volatile char uart_buf [128];
-static volatile uint16_t uart_buf_len = 0;
+#define FITS_BYTE(n) ((n) >= -128 && (n) <= 127)
 
-void hpgl_received(char c)
+static void lex_param(struct hpgl *h)
 {
-	if (uart_buf_len >= sizeof(uart_buf)) {
-		overflow = 1;
+	struct hpgl_lexer *lexer = &h->lexer;
+
+	if (!lexer->digits) {
 		return;
 	}
 
-	uart_buf[uart_buf_len++] = c;
+	int16_t n = lexer->negative ? -lexer->value : lexer->value;
+
+	lexer->digits = 0;
+	lexer->negative = 0;
+	lexer->value = 0;
+	lexer->param ^= 1;
+
+	if (lexer->param) {
+		if (FITS_BYTE(n)) {
+			lexer->first = n;
+			lexer->pending = 1;
+		} else {
+			h->push(h, TOKEN_PARAM, n);
+		}
+
+		return;
+	}
+
+	if (lexer->pending) {
+		lexer->pending = 0;
+
+		if (FITS_BYTE(n)) {
+			h->push(h, TOKEN_PAIR, (int16_t) ((uint8_t) lexer->first << 8 |
+					(uint8_t) n));
+			return;
+		}
+
+		h->push(h, TOKEN_PARAM, lexer->first);
+	}
+
+	h->push(h, TOKEN_PARAM, n);
 }
 
-void hpgl_loop()
+/* Ends the command being lexed with its last parameter and TOKEN_END */
+static void lex_end(struct hpgl *h)
 {
-	while (1) {
-		char c;
+	struct hpgl_lexer *lexer = &h->lexer;
 
-		if (overflow) {
-			uart_send_str("overflow");
+	lex_param(h);
+
+	if (lexer->pending) {
+		h->push(h, TOKEN_PARAM, lexer->first);
+	}
+
+	h->push(h, TOKEN_END, 0);
+	lexer->param = 0;
+	lexer->pending = 0;
+}
+
+void hpgl_lex(struct hpgl *h, char c)
+{
+	struct hpgl_lexer *lexer = &h->lexer;
+
+	if (c == ';' || c == 0x03) {
+		/* As before the lexer, a ';' ends a label but is still printed */
+		if (lexer->state == LEX_LABEL && c == ';') {
+			h->push(h, TOKEN_PARAM, c);
+		}
+
+		if (lexer->state != LEX_COMMAND) {
+			lex_end(h);
+		}
+
+		lexer->state = LEX_COMMAND;
+		lexer->mnemonic = 0;
+		return;
+	}
+
+	switch (lexer->state) {
+	case LEX_COMMAND:
+		if ((c < 'A' || c > 'Z') && (c < 'a' || c > 'z')) {
 			break;
 		}
 
-		NVIC_DisableIRQ(USART2_IRQn);
-		if (uart_buf_len) {
-			c = uart_buf[0];
-			for (int i = 1; i < uart_buf_len; i++) {
-				uart_buf[i - 1] = uart_buf[i];
-			}
-			uart_buf_len--;
-			NVIC_EnableIRQ(USART2_IRQn);
-		} else {
-			NVIC_EnableIRQ(USART2_IRQn);
-			__WFI();
-			continue;
+		if (!lexer->mnemonic) {
+			lexer->mnemonic = c;
+			break;
 		}
 
-		*buf_ptr++ = c;
+		h->push(h, TOKEN_COMMAND, MNEMONIC(lexer->mnemonic, c));
 
-		if (c == ';' || c == 0x03) {
-			if (cmd) {
-				cmd->func();
+		if (MNEMONIC(lexer->mnemonic, c) == MNEMONIC('L', 'B')) {
+			lexer->state = LEX_LABEL;
+		} else {
+			lexer->state = LEX_PARAMS;
+		}
 
-				if (cmd->end) {
-					cmd->end();
-				}
+		lexer->mnemonic = 0;
+		break;
+	case LEX_PARAMS:
+		if (c >= '0' && c <= '9') {
+			if (lexer->value < 3276) {
+				lexer->value = lexer->value * 10 + (c - '0');
 			}
 
-			xy_state = 0;
-			cmd = 0;
-			buf_ptr = buf;
-			continue;
+			lexer->digits++;
+		} else if (c == '-') {
+			lexer->negative = 1;
+		} else if (c == ',') {
+			lex_param(h);
+		} else if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')) {
+			/* As before the lexer, a mnemonic may follow a command
+			 * without a ';', as in "PUPA100,200;" */
+			lex_end(h);
+			lexer->state = LEX_COMMAND;
+			lexer->mnemonic = c;
 		}
+		break;
+	case LEX_LABEL:
+		h->push(h, TOKEN_PARAM, c);
+		break;
+	}
+}
 
-		if (buf_ptr == buf + sizeof(buf)) {
-			uart_send_str("buf overflow\n");
-			return;
-		}
+/* Abandons the command being lexed, if any, ending it with TOKEN_RESYNC */
+void hpgl_lex_reset(struct hpgl *h)
+{
+	if (h->lexer.state != LEX_COMMAND) {
+		h->push(h, TOKEN_RESYNC, 0);
+	}
 
-		if (cmd) {
-			cmd->func();
-		}
+	h->lexer = (struct hpgl_lexer) {0};
+}
 
-		for (size_t i = 0; i < sizeof(cmds) / sizeof(*cmds); i++) {
-			if ((unsigned) (buf_ptr - buf) == strlen(cmds[i].str) &&
-					strncmp(buf, cmds[i].str, strlen(cmds[i].str)) == 0) {
-				buf_ptr = buf;
-				cmd = &cmds[i];
+void hpgl_token(struct hpgl *h, uint8_t type, int16_t value)
+{
+	const struct hpgl_cmd *cmd = h->cmd;
 
-				if (cmd->start) {
-					cmd->start();
-				}
+	switch (type) {
+	case TOKEN_COMMAND:
+		cmd = 0;
 
+		for (size_t i = 0; i < sizeof(cmds) / sizeof(*cmds); i++) {
+			if (cmds[i].mnemonic == (uint16_t) value) {
+				cmd = &cmds[i];
 				break;
 			}
 		}
-	}
 
-	while (1) __NOP();
+		h->cmd = cmd;
+
+		if (cmd && cmd->start) {
+			cmd->start(h);
+		}
+		break;
+	case TOKEN_PARAM:
+		if (cmd) {
+			cmd->func(h, value);
+		}
+		break;
+	case TOKEN_PAIR:
+		if (cmd) {
+			cmd->func(h, (int8_t) (value >> 8));
+			cmd->func(h, (int8_t) value);
+		}
+		break;
+	case TOKEN_END:
+		if (cmd && cmd->end) {
+			cmd->end(h);
+		}
+
+		h->xy_state = 0;
+		h->cmd = 0;
+		break;
+	case TOKEN_RESYNC:
+		if (cmd && cmd->end) {
+			cmd->end(h);
+		}
+
+		if (h->pen) {
+			op(h, OP_RESYNC);
+		}
+
+		h->xy_state = 0;
+		h->cmd = 0;
+		break;
+	}
 }
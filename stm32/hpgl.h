@@ -20,7 +20,79 @@
 #ifndef HPGL_H
 #define HPGL_H
 
-void hpgl_received(char c);
-void hpgl_loop();
+#include "common.h"
+#include <stdint.h>
+
+/* hpgl.c converts HPGL into the drawing operations defined in common.h. It
+ * has no hardware dependencies so that dsoctl can build the same converter,
+ * and all of its state is kept in struct hpgl so that several conversions
+ * can run at once.
+ *
+ * hpgl_lex() splits the HPGL stream into tokens and passes them to the push
+ * callback. The tokens are then handed back, possibly later, to
+ * hpgl_token(), which writes the resulting operations with the emit
+ * callback, one whole operation per call. The optional boundary callback is
+ * called before a capture's first operation and after its last. Two
+ * parameters that both fit in a byte, such as the relative
+ * moves that make up a trace, share a single TOKEN_PAIR. Label characters
+ * are passed as parameters of the LB command. */
+enum {
+	TOKEN_COMMAND,
+	TOKEN_PARAM,
+	TOKEN_PAIR,
+	TOKEN_END,
+	TOKEN_RESYNC,
+};
+
+struct hpgl;
+
+typedef void (*hpgl_push_func)(struct hpgl *h, uint8_t type, int16_t value);
+typedef void (*hpgl_emit_func)(struct hpgl *h, const void *data, uint8_t len);
+typedef void (*hpgl_boundary_func)(struct hpgl *h, int begin);
+
+struct hpgl_lexer {
+	uint8_t state;
+	char mnemonic;
+	uint8_t digits;
+	uint8_t negative;
+	uint8_t param;
+	uint8_t pending;
+	int16_t value;
+	int16_t first;
+};
+
+struct hpgl_run {
+	uint8_t active;
+	uint8_t count;
+	int8_t dx;
+	int16_t x, y;
+	int16_t last_x, last_y;
+	uint8_t op [OP_RUN_HEADER + OP_RUN_MAX / 2];
+};
+
+struct hpgl {
+	struct hpgl_lexer lexer;
+	struct hpgl_run run;
+	const struct hpgl_cmd *cmd;
+
+	int pen;
+	int pen_down;
+	int line_type;
+	int sent_line_type;
+	int x, y;
+	int old_x, old_y;
+	int xy_state;
+
+	hpgl_push_func push;
+	hpgl_emit_func emit;
+	hpgl_boundary_func boundary;
+	void *ctx;
+};
+
+void hpgl_init(struct hpgl *h, hpgl_push_func push, hpgl_emit_func emit,
+		void *ctx);
+void hpgl_lex(struct hpgl *h, char c);
+void hpgl_lex_reset(struct hpgl *h);
+void hpgl_token(struct hpgl *h, uint8_t type, int16_t value);
 
 #endif /* HPGL_H */
@@ -17,7 +17,9 @@
  * 3. This notice may not be removed or altered from any source distribution.
  */
 
-#include "hpgl.h"
+#include "capture.h"
+#include "store.h"
+#include "trace.h"
 #include "uart.h"
 #include "usb.h"
 #include <usblib.h>
@@ -43,6 +45,9 @@ void rcc_init()
 void boot()
 {
 	rcc_init();
+	trace_init();
+	store_init();
+	capture_init();
 	uart_init();
 
 	RCC->AHBENR |= RCC_AHBENR_GPIOAEN;
@@ -61,5 +66,5 @@ void boot()
 
 	uart_send_str("booted\n");
 
-	hpgl_loop();
+	capture_loop();
 }
@@ -0,0 +1,474 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "store.h"
+#include "flash.h"
+#include "uart.h"
+#include "usb.h"
+#include "common.h"
+#include <stddef.h>
+
+/* Captures stored in a ring of otherwise unused flash pages, between the
+ * linker's _store_start and _store_end, so that the oscilloscope can plot
+ * at full speed with nobody reading the adapter. The drawing operations of
+ * a capture are collected in one of two RAM chunks while the other is
+ * programmed a few half-words at a time by store_poll().
+ *
+ * Each capture starts a new page with a record header. Its length is
+ * programmed when the capture ends, so a capture cut short by a reset is
+ * never listed. Pages are erased ahead of the write position while the
+ * UART is idle, and during a capture once the token queue is drained or
+ * when the erased pages run out. An erase stalls the CPU, so the UART is
+ * held meanwhile. A capture may take the whole ring, overwriting the older
+ * ones, and is stored truncated only if it outgrows that. A capture that
+ * begins with no page erased waits for one. */
+#define STORE_MAGIC 0x41534f44 /* "DOSA" */
+#define STORE_CHUNK 256
+#define STORE_AHEAD (4 * FLASH_PAGE)
+#define STORE_BURST 8
+#define STORE_UNSET 0xFFFFFFFF
+
+struct store_record {
+	uint32_t magic;
+	uint32_t seq;
+	uint16_t id;
+	uint16_t reserved;
+	uint32_t length; /* bytes stored, STORE_UNSET until the capture ends */
+	uint32_t bytes;  /* bytes in the capture */
+};
+
+extern uint8_t _store_start [];
+extern uint8_t _store_end [];
+
+#define STORE_SIZE ((uint32_t) (_store_end - _store_start))
+
+/* A capture may use the whole ring but the start of its own page */
+#define STORE_CAPACITY (STORE_SIZE - sizeof(struct store_record))
+
+static struct {
+	volatile uint8_t enabled;
+	volatile uint8_t list_requested;
+	volatile uint8_t fetch_requested;
+	volatile uint16_t fetch_seq;
+	uint32_t seq;
+	uint32_t write;  /* offset of the next half-word to program */
+	uint32_t erased; /* bytes erased from write up to a page boundary */
+	uint8_t active;
+	uint8_t truncated;
+	uint32_t record;
+	uint32_t length;
+	uint32_t bytes;
+	uint8_t chunks [2][STORE_CHUNK];
+	uint8_t fill;
+	uint16_t fill_len;
+	int8_t pending;
+	uint16_t pending_len;
+	uint16_t pending_pos;
+} store;
+
+static const struct store_record *record_at(uint32_t offset)
+{
+	return (const struct store_record *) (_store_start + offset);
+}
+
+static int record_valid(const struct store_record *r)
+{
+	return r->magic == STORE_MAGIC && r->length != STORE_UNSET &&
+		r->length <= STORE_SIZE - sizeof(*r) && r->length <= r->bytes;
+}
+
+static uint32_t record_pages(const struct store_record *r)
+{
+	return (sizeof(*r) + r->length + FLASH_PAGE - 1) / FLASH_PAGE;
+}
+
+static int page_erased(uint32_t offset)
+{
+	const uint32_t *word = (const uint32_t *) (_store_start + offset);
+
+	for (uint32_t i = 0; i < FLASH_PAGE / sizeof(*word); i++) {
+		if (word[i] != STORE_UNSET) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Carries on after the newest complete capture */
+void store_init()
+{
+	const struct store_record *newest = 0;
+
+	store.pending = -1;
+	store.write = 0;
+	store.erased = 0;
+	store.seq = 0;
+	store.record = STORE_UNSET;
+
+	for (uint32_t offset = 0; offset < STORE_SIZE; offset += FLASH_PAGE) {
+		const struct store_record *r = record_at(offset);
+
+		if (r->magic != STORE_MAGIC) {
+			continue;
+		}
+
+		if (r->seq != STORE_UNSET && r->seq > store.seq) {
+			store.seq = r->seq;
+		}
+
+		if (record_valid(r) && (!newest || r->seq > newest->seq)) {
+			newest = r;
+			store.record = offset;
+			store.write = (offset + record_pages(r) * FLASH_PAGE) % STORE_SIZE;
+		}
+	}
+
+	store.seq++;
+
+	while (store.erased < STORE_SIZE &&
+			page_erased((store.write + store.erased) % STORE_SIZE)) {
+		store.erased += FLASH_PAGE;
+	}
+}
+
+/* Called from the USB interrupt, like the requests below */
+void store_set_enabled(uint16_t enabled)
+{
+	store.enabled = enabled != 0;
+}
+
+/* Captures are also stored whenever the host is not reading them, so that
+ * none is lost with nobody reading the adapter */
+int store_enabled()
+{
+	return store.enabled || !usb_host_reading();
+}
+
+void store_request_list()
+{
+	store.list_requested = 1;
+}
+
+void store_request_fetch(uint16_t seq)
+{
+	store.fetch_seq = seq;
+	store.fetch_requested = 1;
+}
+
+/* Erases the page after the erased ones, unless it holds the start of the
+ * capture being stored or, between captures, of the newest one */
+static int erase_next()
+{
+	uint32_t page = (store.write + store.erased) % STORE_SIZE;
+
+	if (store.erased >= STORE_SIZE || page == store.record) {
+		return 0;
+	}
+
+	uart_hold_rx();
+	flash_erase(_store_start + page);
+	uart_release_rx();
+	store.erased += FLASH_PAGE;
+
+	return 1;
+}
+
+/* Bytes of the capture waiting in RAM to be programmed */
+static uint32_t buffered()
+{
+	return store.fill_len +
+		(store.pending < 0 ? 0 : store.pending_len - store.pending_pos);
+}
+
+static void program(uint32_t offset, uint16_t value)
+{
+	flash_program(_store_start + offset % STORE_SIZE, value);
+}
+
+static void program_pending(uint16_t max)
+{
+	if (store.pending < 0) {
+		return;
+	}
+
+	const uint8_t *chunk = store.chunks[store.pending];
+
+	while (store.pending_pos < store.pending_len && max--) {
+		uint16_t pos = store.pending_pos;
+		uint16_t value = chunk[pos] |
+			(pos + 1 < store.pending_len ? chunk[pos + 1] : 0xFF) << 8;
+
+		program(store.write, value);
+		store.write = (store.write + 2) % STORE_SIZE;
+		store.erased -= 2;
+		store.pending_pos += 2;
+	}
+
+	if (store.pending_pos >= store.pending_len) {
+		store.pending = -1;
+	}
+}
+
+/* Hands the filled chunk over to be programmed, finishing the previous one
+ * first if it is still being programmed */
+static void queue_chunk()
+{
+	program_pending(STORE_CHUNK);
+
+	store.pending = store.fill;
+	store.pending_len = store.fill_len;
+	store.pending_pos = 0;
+	store.fill ^= 1;
+	store.fill_len = 0;
+}
+
+void store_begin(uint16_t id)
+{
+	/* With no page erased, the capture waits for one rather than being
+	 * lost, even if the newest capture is overwritten */
+	if (store.erased < FLASH_PAGE) {
+		store.record = STORE_UNSET;
+		erase_next();
+	}
+
+	struct store_record header = {
+		.magic = STORE_MAGIC,
+		.seq = store.seq,
+		.id = id,
+	};
+	const uint16_t *half = (const uint16_t *) &header;
+
+	/* length and bytes are left erased until the end */
+	for (uint32_t i = 0; i < offsetof(struct store_record, length) / 2; i++) {
+		program(store.write + i * 2, half[i]);
+	}
+
+	store.record = store.write;
+	store.write += sizeof(header);
+	store.erased -= sizeof(header);
+	store.length = 0;
+	store.bytes = 0;
+	store.truncated = 0;
+	store.fill_len = 0;
+	store.active = 1;
+}
+
+void store_write(const void *data, uint8_t len)
+{
+	const uint8_t *src = data;
+
+	if (!store.active) {
+		return;
+	}
+
+	store.bytes += len;
+
+	if (store.truncated || store.length + len > STORE_CAPACITY) {
+		store.truncated = 1;
+		return;
+	}
+
+	while (buffered() + len > store.erased) {
+		if (!erase_next()) {
+			store.truncated = 1;
+			return;
+		}
+	}
+
+	store.length += len;
+
+	while (len--) {
+		store.chunks[store.fill][store.fill_len++] = *src++;
+
+		if (store.fill_len == STORE_CHUNK) {
+			queue_chunk();
+		}
+	}
+}
+
+void store_end()
+{
+	if (!store.active) {
+		return;
+	}
+
+	if (store.fill_len) {
+		queue_chunk();
+	}
+
+	program_pending(STORE_CHUNK);
+
+	uint32_t length = offsetof(struct store_record, length);
+
+	program(store.record + length, store.length);
+	program(store.record + length + 2, store.length >> 16);
+	program(store.record + length + 4, store.bytes);
+	program(store.record + length + 6, store.bytes >> 16);
+
+	uint32_t pad = (FLASH_PAGE - store.write % FLASH_PAGE) % FLASH_PAGE;
+
+	store.write = (store.write + pad) % STORE_SIZE;
+	store.erased -= pad;
+	store.seq++;
+	store.active = 0;
+}
+
+/* Offset of the oldest complete capture with a seq above after */
+static uint32_t find_after(uint32_t after)
+{
+	uint32_t found = STORE_UNSET;
+
+	for (uint32_t offset = 0; offset < STORE_SIZE; offset += FLASH_PAGE) {
+		const struct store_record *r = record_at(offset);
+
+		if (record_valid(r) && r->seq > after && (found == STORE_UNSET ||
+				r->seq < record_at(found)->seq)) {
+			found = offset;
+		}
+	}
+
+	return found;
+}
+
+static void send_entry(uint8_t index, uint8_t total,
+		const struct store_record *r)
+{
+	struct usb_packet_store_entry packet = {
+		.index = index,
+		.total = total,
+	};
+
+	if (r) {
+		packet.id = r->id;
+		packet.capture_seq = r->seq;
+		packet.stored = r->length;
+		packet.bytes = r->bytes;
+	}
+
+	usb_log_packet(USB_PACKET_STORE_ENTRY,
+			(uint8_t *) &packet + USB_PACKET_HEADER,
+			sizeof(packet) - USB_PACKET_HEADER);
+}
+
+static void list()
+{
+	uint8_t total = 0;
+	uint32_t seq = 0;
+	uint32_t offset;
+
+	while ((offset = find_after(seq)) != STORE_UNSET) {
+		seq = record_at(offset)->seq;
+		total++;
+	}
+
+	if (!total) {
+		send_entry(0, 0, 0);
+		return;
+	}
+
+	seq = 0;
+
+	for (uint8_t i = 0; i < total; i++) {
+		const struct store_record *r = record_at(find_after(seq));
+
+		send_entry(i, total, r);
+		seq = r->seq;
+	}
+}
+
+/* Sends a stored capture as its drawing operations were sent live, a whole
+ * operation to a log packet */
+static void fetch(uint16_t seq)
+{
+	const struct store_record *r = 0;
+
+	for (uint32_t offset = 0; offset < STORE_SIZE; offset += FLASH_PAGE) {
+		const struct store_record *c = record_at(offset);
+
+		if (record_valid(c) && (uint16_t) c->seq == seq &&
+				(!r || c->seq > r->seq)) {
+			r = c;
+		}
+	}
+
+	if (!r) {
+		send_entry(0, 0, 0);
+		return;
+	}
+
+	struct usb_packet_capture_begin begin = {.id = r->id};
+	struct usb_packet_capture_end end = {.id = r->id, .bytes = r->bytes};
+	uint32_t start = (const uint8_t *) r - _store_start + sizeof(*r);
+	uint8_t op [OP_RUN_HEADER + OP_RUN_MAX / 2];
+
+	usb_log_packet(USB_PACKET_CAPTURE_BEGIN,
+			(uint8_t *) &begin + USB_PACKET_HEADER,
+			sizeof(begin) - USB_PACKET_HEADER);
+
+	for (uint32_t pos = 0; pos < r->length; ) {
+		uint8_t len = 0;
+		uint8_t size = 1;
+
+		while (len < size && pos < r->length) {
+			op[len++] = _store_start[(start + pos++) % STORE_SIZE];
+			size = op_size(op, len);
+		}
+
+		usb_log_data(USB_PACKET_LOG, op, len);
+	}
+
+	usb_log_packet(USB_PACKET_CAPTURE_END,
+			(uint8_t *) &end + USB_PACKET_HEADER,
+			sizeof(end) - USB_PACKET_HEADER);
+}
+
+/* Called from the main loop, with idle set while no capture is in progress
+ * and no input is expected, and drained while the token queue is empty */
+void store_poll(int idle, int drained)
+{
+	program_pending(STORE_BURST);
+
+	/* A page is kept erased ahead of a capture, so that it seldom waits
+	 * for an erase with tokens queued */
+	if (store.active && drained &&
+			store.erased < buffered() + FLASH_PAGE) {
+		erase_next();
+	}
+
+	if (!idle || store.active) {
+		return;
+	}
+
+	if (store.list_requested) {
+		store.list_requested = 0;
+		list();
+	}
+
+	if (store.fetch_requested) {
+		store.fetch_requested = 0;
+		fetch(store.fetch_seq);
+	}
+
+	/* Only when asked to store, as a boot without a host would otherwise
+	 * erase stored captures; diverted ones erase as they go */
+	if (store.enabled && store.erased < STORE_AHEAD) {
+		erase_next();
+	}
+}
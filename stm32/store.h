@@ -0,0 +1,36 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+
+void store_init();
+void store_set_enabled(uint16_t enabled);
+int store_enabled();
+void store_request_list();
+void store_request_fetch(uint16_t seq);
+
+void store_begin(uint16_t id);
+void store_write(const void *data, uint8_t len);
+void store_end();
+void store_poll(int idle, int drained);
+
+#endif /* STORE_H */
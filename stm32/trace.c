@@ -0,0 +1,136 @@
+/* Copyright (C) 2021 Sam Bazley
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty.  In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ * 2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#include "trace.h"
+#include "usb.h"
+#include "common.h"
+#include <stm32f0xx.h>
+
+/* Ring of the most recent events, timestamped by TIM2 counting at 1 MHz.
+ * Recording is suspended while the ring is being dumped, so that the dump
+ * does not trace its own packets.
+ *
+ * Every event takes 8 bytes of the 6 KB of RAM, so the ring is sized by the
+ * Makefile's TRACE_LEN, at most 255. The default of 64 covers the last few
+ * commands and USB transfers of a capture, and 0 leaves tracing out, with
+ * empty dumps. */
+#ifndef TRACE_LEN
+#define TRACE_LEN 64
+#endif
+
+#define RING_LEN (TRACE_LEN ? TRACE_LEN : 1)
+
+static struct trace_event events [RING_LEN];
+static uint8_t trace_head = 0;
+static uint8_t trace_count = 0;
+static volatile uint8_t dump_requested = 0;
+static uint8_t dumping = 0;
+
+void trace_init()
+{
+	RCC->APB1ENR |= RCC_APB1ENR_TIM2EN;
+
+	TIM2->PSC = 48 - 1;
+	TIM2->ARR = 0xFFFFFFFF;
+	TIM2->EGR = TIM_EGR_UG;
+	TIM2->CR1 |= TIM_CR1_CEN;
+}
+
+uint32_t trace_time()
+{
+	return TIM2->CNT;
+}
+
+void trace(uint8_t type, uint16_t value)
+{
+#if TRACE_LEN
+	if (dumping) {
+		return;
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	struct trace_event *event = &events[trace_head];
+
+	event->time = trace_time();
+	event->value = value;
+	event->type = type;
+
+	trace_head = (trace_head + 1) % RING_LEN;
+
+	if (trace_count < TRACE_LEN) {
+		trace_count++;
+	}
+
+	__set_PRIMASK(primask);
+#else
+	(void) type;
+	(void) value;
+#endif
+}
+
+/* Called from the USB interrupt, the dump itself is sent by trace_poll() */
+void trace_request_dump()
+{
+	dump_requested = 1;
+}
+
+static void dump()
+{
+	struct usb_packet_trace packet;
+	uint8_t first = (trace_head + RING_LEN - trace_count) % RING_LEN;
+	uint8_t index = 0;
+
+	dumping = 1;
+
+	do {
+		uint8_t n = trace_count - index;
+
+		if (n > TRACE_PACKET_EVENTS) {
+			n = TRACE_PACKET_EVENTS;
+		}
+
+		packet.index = index;
+		packet.total = trace_count;
+		packet.reserved = 0;
+
+		for (uint8_t i = 0; i < n; i++) {
+			packet.events[i] = events[(first + index + i) % RING_LEN];
+		}
+
+		usb_log_packet(USB_PACKET_TRACE,
+				(uint8_t *) &packet + USB_PACKET_HEADER,
+				sizeof(packet) - USB_PACKET_HEADER -
+				(TRACE_PACKET_EVENTS - n) * sizeof(*packet.events));
+
+		index += n;
+	} while (index < trace_count);
+
+	trace_count = 0;
+	dumping = 0;
+}
+
+void trace_poll()
+{
+	if (dump_requested) {
+		dump_requested = 0;
+		dump();
+	}
+}
@@ -18,16 +18,31 @@
  */
 
 #include "uart.h"
-#include "hpgl.h"
+#include "capture.h"
 #include <stm32f0xx.h>
 
 #define USART USART2
 #define TX 2
 #define RX 3
 
+/* Transmit ring buffer, drained by the TXE interrupt. Characters sent while
+ * the buffer is full are dropped rather than blocking the caller, which may
+ * be running in interrupt context. */
+static volatile char tx_buf [64];
+static volatile uint8_t tx_head = 0;
+static volatile uint8_t tx_tail = 0;
+
+/* While a flash page is erased the CPU can not take the RXNE interrupt, so
+ * input is received by DMA meanwhile. 48 bytes last the longest erase,
+ * 40 ms, at 9600 baud. */
+#define RX_DMA DMA1_Channel5
+
+static volatile char rx_hold [48];
+
 void uart_init()
 {
 	RCC->AHBENR |= RCC_AHBENR_GPIOAEN;
+	RCC->AHBENR |= RCC_AHBENR_DMAEN;
 	RCC->APB1ENR |= RCC_APB1ENR_USART2EN;
 
 	GPIOA->MODER |= 2 << (2 * TX);
@@ -50,11 +65,18 @@ void uart_init()
 
 void uart_send(char c)
 {
-	while (!(USART->ISR & USART_ISR_TC)) {
-		__NOP();
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint8_t next = (tx_head + 1) % sizeof(tx_buf);
+
+	if (next != tx_tail) {
+		tx_buf[tx_head] = c;
+		tx_head = next;
+		USART->CR1 |= USART_CR1_TXEIE;
 	}
 
-	USART->TDR = c;
+	__set_PRIMASK(primask);
 }
 
 void uart_send_str(const char *str)
@@ -89,8 +111,59 @@ void uart_send_int(uint32_t n)
 	}
 }
 
+/* Receives into rx_hold by DMA until uart_release_rx() */
+void uart_hold_rx()
+{
+	USART->CR1 &= ~USART_CR1_RXNEIE;
+
+	RX_DMA->CCR = 0;
+	RX_DMA->CPAR = (uint32_t) &USART->RDR;
+	RX_DMA->CMAR = (uint32_t) rx_hold;
+	RX_DMA->CNDTR = sizeof(rx_hold);
+	RX_DMA->CCR = DMA_CCR_MINC | DMA_CCR_EN;
+
+	USART->CR3 |= USART_CR3_DMAR;
+}
+
+/* Passes on the input held, in order: a byte arriving meanwhile waits in
+ * RDR for the interrupt */
+void uart_release_rx()
+{
+	USART->CR3 &= ~USART_CR3_DMAR;
+	RX_DMA->CCR = 0;
+
+	uint8_t held = sizeof(rx_hold) - RX_DMA->CNDTR;
+
+	for (uint8_t i = 0; i < held; i++) {
+		capture_received(rx_hold[i]);
+	}
+
+	USART->CR1 |= USART_CR1_RXNEIE;
+}
+
+static void uart_tx_irq()
+{
+	if (tx_tail == tx_head) {
+		USART->CR1 &= ~USART_CR1_TXEIE;
+		return;
+	}
+
+	USART->TDR = tx_buf[tx_tail];
+	tx_tail = (tx_tail + 1) % sizeof(tx_buf);
+}
+
 void uart2_irq()
 {
-	USART->RQR |= USART_RQR_RXFRQ;
-	hpgl_received(USART->RDR);
+	if (USART->ISR & USART_ISR_RXNE) {
+		USART->RQR |= USART_RQR_RXFRQ;
+		capture_received(USART->RDR);
+	}
+
+	if (USART->ISR & USART_ISR_ORE) {
+		USART->ICR = USART_ICR_ORECF;
+	}
+
+	if ((USART->CR1 & USART_CR1_TXEIE) && (USART->ISR & USART_ISR_TXE)) {
+		uart_tx_irq();
+	}
 }
@@ -28,4 +28,7 @@ void uart_send(char c);
 void uart_send_str(const char *str);
 void uart_send_int(uint32_t n);
 
+void uart_hold_rx();
+void uart_release_rx();
+
 #endif /* UART_H */
@@ -19,10 +19,13 @@
 
 #include "usb.h"
 #include "uart.h"
+#include "capture.h"
+#include "generator.h"
+#include "store.h"
+#include "trace.h"
 #include "common.h"
 #include <usblib.h>
 #include <stm32f0xx.h>
-#include <string.h>
 
 static struct usb_endpoint endpoints [] = {
 	{64, 64, USB_EP_CONTROL, DIR_BIDIR},
@@ -143,12 +146,46 @@ static struct usb_descriptor descriptors [] = {
 	DESCRIPTOR(DESC_STRING, 3, 0x0409, serial_no_str),
 };
 
+static volatile uint8_t host_reading;
+
 static void on_control_out_interface0(struct usb_interface *iface,
 		struct usb_setup_packet *sp)
 {
 	(void) iface;
 
+	/* A client sending requests is taken to be reading, until a packet
+	 * goes uncollected */
+	host_reading = 1;
+
 	switch (sp->bRequest) {
+	case USB_REQ_SET_MODE:
+		capture_set_mode(sp->wValue);
+		usb_ack(0);
+		break;
+	case USB_REQ_TRACE:
+		trace_request_dump();
+		usb_ack(0);
+		break;
+	case USB_REQ_GENERATE:
+		if (sp->wValue & 0xFF) {
+			generator_start(sp->wValue & 0xFF, sp->wValue >> 8);
+		} else {
+			generator_stop();
+		}
+		usb_ack(0);
+		break;
+	case USB_REQ_STORE:
+		store_set_enabled(sp->wValue);
+		usb_ack(0);
+		break;
+	case USB_REQ_STORE_LIST:
+		store_request_list();
+		usb_ack(0);
+		break;
+	case USB_REQ_STORE_FETCH:
+		store_request_fetch(sp->wValue);
+		usb_ack(0);
+		break;
 	default:
 		uart_send_str("== UNHANDLED INTERFACE 0 REQUEST ");
 		uart_send_int(sp->bRequest);
@@ -204,96 +241,175 @@ static struct usb_interface interfaces [] = {
 	{1, 0, on_control_out_interface1},
 };
 
-size_t strnlen(const char *s, size_t maxlen)
-{
-	for (size_t i = 0; i < maxlen; i++) {
-		if (s[i] == 0) {
-			return i;
-		}
-	}
-
-	return maxlen;
-}
-
-static volatile struct usb_packet_log log_packet;
+/* Log output is written directly into one of two packets: one is filled
+ * while the other is owned by the USB peripheral until its transfer
+ * completes.
+ *
+ * A partly filled packet is held back for up to USB_FLUSH_MS milliseconds in
+ * case more data follows. After that it is sent by the SysTick interrupt or
+ * by the completion of the packet in flight, so the end of a capture never
+ * waits for the next one. log_busy keeps the interrupts away while the main
+ * loop is writing to the packet.
+ *
+ * The host has stopped reading once a packet has waited USB_DRAIN_MS
+ * milliseconds to be collected. Data that would wait for it is dropped
+ * instead, and captures are stored until the host reads again. */
+#ifndef USB_FLUSH_MS
+#define USB_FLUSH_MS 1
+#endif
+
+#ifndef USB_DRAIN_MS
+#define USB_DRAIN_MS 100
+#endif
+
+static struct usb_packet_log log_packets [2] = {
+	{USB_PACKET_HEADER, USB_PACKET_LOG, 0, 0, {0}},
+	{USB_PACKET_HEADER, USB_PACKET_LOG, 0, 0, {0}},
+};
+static volatile uint8_t log_fill = 0;
+static volatile uint8_t log_closed = 0;
+static volatile uint8_t log_busy = 0;
+static volatile uint8_t log_age = 0;
+static uint8_t log_seq = 0;
 static volatile int send_complete = 1;
+static volatile uint8_t send_age = 0;
+static uint8_t sent_seq = 0;
 
-static char buffer [62] = {0};
-static char *buf_ptr = buffer;
+int usb_host_reading()
+{
+	return host_reading;
+}
 
-static int _usb_log_str(const char *str)
+/* Empties the packet being filled if the host has stopped reading, so that
+ * nothing waits for it */
+static void usb_log_drop()
 {
-	int buf_len = buf_ptr - buffer;
-	int len = strnlen((char *) str, sizeof(buffer) - buf_len);
+	if (!host_reading && !send_complete) {
+		log_packets[log_fill].length = USB_PACKET_HEADER;
+		log_closed = 0;
+	}
+}
 
-	strncpy(buf_ptr, str, len);
+static void usb_log_submit()
+{
+	struct usb_packet_log *packet = &log_packets[log_fill];
 
-	buf_ptr += len;
-	buf_len = buf_ptr - buffer;
+	if (packet->length <= USB_PACKET_HEADER) {
+		return;
+	}
 
 	__disable_irq();
 
 	if (!send_complete) {
-		return len;
+		__enable_irq();
+		return;
 	}
 
 	send_complete = 0;
 
-	log_packet.type = USB_PACKET_LOG;
-	log_packet.length = 2 + buf_len;
-	strncpy((char *) log_packet.payload, (char *) buffer, buf_len);
-	usb_send_data(2, (uint8_t *) &log_packet, log_packet.length, 0);
+	__enable_irq();
 
-	memset(buffer, 0, sizeof(buffer));
-	buf_ptr = buffer;
+	packet->seq = log_seq++;
+	packet->crc = usb_packet_crc(packet);
 
-	__enable_irq();
+	trace(TRACE_USB_SUBMIT, packet->seq);
 
-	return len;
+	/* The next packet is set up before sending, so that a completion
+	 * interrupt always finds it in place */
+	__disable_irq();
+	sent_seq = packet->seq;
+	log_fill ^= 1;
+	log_closed = 0;
+	log_age = 0;
+	send_age = 0;
+	log_packets[log_fill].length = USB_PACKET_HEADER;
+	usb_send_data(2, (uint8_t *) packet, packet->length, 0);
+	__enable_irq();
 }
 
-void usb_log_str(const char *str)
+/* Called from interrupts to send the packet being filled once it is due */
+static void usb_log_flush()
 {
-	GPIOA->ODR &= ~1;
+	struct usb_packet_log *packet = &log_packets[log_fill];
+
+	if (log_busy || packet->length <= USB_PACKET_HEADER) {
+		return;
+	}
 
-	while (*str) {
-		str += _usb_log_str(str);
+	if (log_age >= USB_FLUSH_MS || log_closed ||
+			packet->length == sizeof(*packet)) {
+		usb_log_submit();
 	}
 }
 
-void usb_log_int(uint32_t n)
+static struct usb_packet_log *usb_log_space(uint8_t type, uint8_t len)
 {
-	static char str [sizeof(log_packet.payload)];
-	char *ptr = str;
-	int sending = 0;
+	struct usb_packet_log *packet = &log_packets[log_fill];
 
-	memset(str, 0, sizeof(str));
+	if (len > sizeof(packet->payload)) {
+		len = 1;
+	}
 
-	for (int i = 32; i >= 0; i--) {
-		uint32_t x = n;
+	while (log_closed || sizeof(*packet) - packet->length < len ||
+			(packet->length > USB_PACKET_HEADER && packet->type != type)) {
+		usb_log_submit();
+		usb_log_drop();
+		packet = &log_packets[log_fill];
+	}
 
-		for (int j = 0; j < i; j++) {
-			x /= 10;
-		}
+	packet->type = type;
 
-		x %= 10;
+	return packet;
+}
 
-		if (x) {
-			sending = 1;
+static void usb_log_write(uint8_t type, const uint8_t *src, uint8_t len)
+{
+	while (len) {
+		struct usb_packet_log *packet = usb_log_space(type, len);
+		uint8_t *ptr = (uint8_t *) packet + packet->length;
+		uint8_t *end = (uint8_t *) packet + sizeof(*packet);
+
+		while (len && ptr < end) {
+			*ptr++ = *src++;
+			len--;
 		}
 
-		if (sending) {
-			*ptr++ = '0' + x;
-		}
+		packet->length = ptr - (uint8_t *) packet;
 	}
+}
 
-	if (!sending) {
-		*ptr++ = '0';
+/* Data that fits in a packet is never split between two packets. */
+void usb_log_data(uint8_t type, const void *data, uint8_t len)
+{
+	GPIOA->ODR &= ~1;
+
+	log_busy = 1;
+	usb_log_write(type, data, len);
+
+	if (log_packets[log_fill].length == sizeof(struct usb_packet_log)) {
+		usb_log_submit();
+	}
+
+	log_busy = 0;
+}
+
+/* Sends data as the whole payload of a packet of its own, without waiting
+ * for the flush deadline. */
+void usb_log_packet(uint8_t type, const void *data, uint8_t len)
+{
+	log_busy = 1;
+
+	while (log_packets[log_fill].length > USB_PACKET_HEADER) {
+		usb_log_submit();
+		usb_log_drop();
 	}
 
-	*ptr++ = 0;
+	log_closed = 0;
+	usb_log_write(type, data, len);
+	log_closed = 1;
+	usb_log_submit();
 
-	usb_log_str(str);
+	log_busy = 0;
 }
 
 static void on_correct_transfer(uint8_t ep, uint8_t *data, uint8_t len)
@@ -304,9 +420,27 @@ static void on_correct_transfer(uint8_t ep, uint8_t *data, uint8_t len)
 	if (ep == 0x02) {
 		GPIOA->ODR |= 1;
 		send_complete = 1;
+		host_reading = 1;
+		trace(TRACE_USB_COMPLETE, sent_seq);
+		usb_log_flush();
 	}
 }
 
+void systick_irq()
+{
+	if (!send_complete && send_age < USB_DRAIN_MS &&
+			++send_age == USB_DRAIN_MS) {
+		host_reading = 0;
+	}
+
+	if (log_packets[log_fill].length > USB_PACKET_HEADER &&
+			log_age < USB_FLUSH_MS) {
+		log_age++;
+	}
+
+	usb_log_flush();
+}
+
 static struct usb_configuration conf = {
 	.endpoints = endpoints,
 	.endpoint_count = sizeof(endpoints) / sizeof(struct usb_endpoint),
@@ -322,4 +456,5 @@ static struct usb_configuration conf = {
 void usb_impl_init()
 {
 	usb_init(&conf);
+	SysTick_Config(48000000 / 1000);
 }
@@ -23,7 +23,8 @@
 #include <stdint.h>
 
 void usb_impl_init();
-void usb_log_str(const char *str);
-void usb_log_int(uint32_t n);
+void usb_log_data(uint8_t type, const void *data, uint8_t len);
+void usb_log_packet(uint8_t type, const void *data, uint8_t len);
+int usb_host_reading();
 
 #endif /* USB_H */
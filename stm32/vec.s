@@ -19,7 +19,7 @@ none: b .
 .word none          /* Reserved */
 .word none          /* Reserved */
 .word none          /* PendSV */
-.word none          /* SysTick */
+.word systick_irq   /* SysTick */
 
 .word none          /* 0 */
 .word none          /* 1 */